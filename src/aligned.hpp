@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace gentex {
+
+	// Allocator for std::vector that aligns the storage for SIMD loads
+	template<typename T, size_t Alignment = 64>
+	struct AlignedAllocator {
+		typedef T value_type;
+
+		template<typename U>
+		struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+		AlignedAllocator() {}
+		template<typename U>
+		AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		T* allocate(size_t n) {
+			void* ptr = nullptr;
+#ifdef _MSC_VER
+			ptr = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+			if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+				ptr = nullptr;
+#endif
+			if (!ptr)
+				throw std::bad_alloc();
+			return static_cast<T*>(ptr);
+		}
+
+		void deallocate(T* ptr, size_t) {
+#ifdef _MSC_VER
+			_aligned_free(ptr);
+#else
+			free(ptr);
+#endif
+		}
+
+		template<typename U>
+		bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+		template<typename U>
+		bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+	};
+
+} // namespace
@@ -3,27 +3,21 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <set>
+#include <cstdint>
 
 #include "shunting-yard-cpp/shunting-yard.hpp"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
 
-#define STB_PERLIN_IMPLEMENTATION
-#include "stb/stb_perlin.h"
+#include "noise.hpp"
 
-namespace gentex {
-
-inline float perlin(vec2 p, vec2 period = {}) {
-	return stb_perlin_noise3(p.x, p.y, 0, period.x, period.y, 0);
-}
-
-// TODO: No simplex...
-inline float simplex(vec2 p) {
-	return stb_perlin_noise3(p.x, p.y, 0.5f, 0, 0, 0);
-}
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-inline float rnd() { return rand() / (float)RAND_MAX; }
+namespace gentex {
 
 inline const std::string& parseString(const char* name, const Json& params, const std::string& def = "") {
 	const Json& param = params[name];
@@ -32,11 +26,23 @@ inline const std::string& parseString(const char* name, const Json& params, cons
 	return def;
 }
 
+inline void reportExpression(const std::string& str, calc::Status status) {
+	std::cerr << "malformed math expression \"" << str << "\" (error " << status << ")" << std::endl;
+}
+
+inline double parseExpression(const std::string& str) {
+	calc::Status status;
+	double value = calc::MathExpression::eval(str, &status);
+	if (status != calc::OK)
+		reportExpression(str, status);
+	return value;
+}
+
 inline float parseFloat(const Json& param, float def = 0.f) {
 	if (param.is_number())
 		return param.number_value();
 	else if (param.is_string())
-		return calc::MathExpression::eval(param.string_value());
+		return parseExpression(param.string_value());
 	return def;
 }
 
@@ -76,7 +82,7 @@ inline Color parseColor(const Json& param, Color def = Color(1.f)) {
 		} else if (str[0] == '#') {
 			std::cerr << "malformed hex color string \"" << str << "\"" << std::endl;
 		} else {
-			return Color(calc::MathExpression::eval(str));
+			return Color(parseExpression(str));
 		}
 	}
 	return def;
@@ -86,6 +92,30 @@ inline Color parseColor(const char* name, const Json& params, Color def = Color(
 	return parseColor(params[name], def);
 }
 
+// Interpolates count positions in a table of size + 1 values over [0, 1],
+// clamping the positions
+static void lookupTable(const float* table, int size, const float* pos, int count, float* out) {
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256 scale = _mm256_set1_ps(size);
+	const __m256i last = _mm256_set1_epi32(size - 1);
+	for (; i + 8 <= count; i += 8) {
+		__m256 p = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(pos + i), _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+		__m256 t = _mm256_mul_ps(p, scale);
+		__m256i index = _mm256_min_epi32(_mm256_cvttps_epi32(t), last);
+		__m256 frac = _mm256_sub_ps(t, _mm256_cvtepi32_ps(index));
+		__m256 a = _mm256_i32gather_ps(table, index, 4);
+		__m256 b = _mm256_i32gather_ps(table + 1, index, 4);
+		_mm256_storeu_ps(out + i, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), frac)));
+	}
+#endif
+	for (; i < count; ++i) {
+		float t = clamp(pos[i], 0.f, 1.f) * size;
+		int index = clamp(int(t), 0, size - 1);
+		out[i] = table[index] + (table[index + 1] - table[index]) * (t - index);
+	}
+}
+
 struct ColorInterpolator {
 	struct GradientPoint { float pos; Color color; };
 
@@ -117,322 +147,920 @@ struct ColorInterpolator {
 		} else std::cerr << "malformed gradient color array" << std::endl;
 	}
 
-	Color get(Color pos) {
+	Color get(Color pos) const {
 		// TODO: Repeat?
 		// TODO: Handle all components separately
+		if (points.size() < 2)
+			return points.empty() ? Color(0.f) : points[0].color;
+		// Positions outside the stops take the color of the nearest end
 		uint i = 0;
-		while (i < points.size()-1 && points[i+1].pos < pos.r) ++i;
-		GradientPoint& p1 = points[i];
-		GradientPoint& p2 = points[i+1];
-		float alpha = (pos.r - p1.pos) / (p2.pos - p1.pos);
+		while (i < points.size()-2 && points[i+1].pos < pos.r) ++i;
+		const GradientPoint& p1 = points[i];
+		const GradientPoint& p2 = points[i+1];
+		float alpha = clamp((pos.r - p1.pos) / (p2.pos - p1.pos), 0.f, 1.f);
 		return mix(p1.color, p2.color, alpha);
 	}
 
+	// Tabulates the gradient over [0, 1] for the span version of get(),
+	// each entry with the step to the next one for interpolating
+	void buildTable() {
+		table.resize(TABLE_SIZE + 1);
+		for (int i = 0; i <= TABLE_SIZE; ++i)
+			table[i].color = get(Color(i / float(TABLE_SIZE)));
+		for (int i = 0; i < TABLE_SIZE; ++i)
+			table[i].delta = table[i + 1].color - table[i].color;
+		for (int c = 0; c < 3; ++c) {
+			channelTables[c].resize(TABLE_SIZE + 1);
+			for (int i = 0; i <= TABLE_SIZE; ++i)
+				channelTables[c][i] = table[i].color.v[c];
+		}
+	}
+
+	// Colors of count (at most Image::SPAN_SIZE) positions times tint. With
+	// the table each is one lookup whatever the number of stops, positions
+	// outside [0, 1] still go through get().
+	void get(const float* pos, int count, Color tint, Color* out) const {
+		if (table.empty()) {
+			for (int i = 0; i < count; ++i)
+				out[i] = get(Color(pos[i])) * tint;
+			return;
+		}
+		int index[Image::SPAN_SIZE];
+		float frac[Image::SPAN_SIZE];
+		for (int i = 0; i < count; ++i) {
+			float t = clamp(pos[i], 0.f, 1.f) * TABLE_SIZE;
+			index[i] = clamp(int(t), 0, TABLE_SIZE - 1);
+			frac[i] = t - index[i];
+		}
+		for (int i = 0; i < count; ++i) {
+			const TableEntry& entry = table[index[i]];
+			bool inside = pos[i] >= 0.f && pos[i] <= 1.f;
+			out[i] = (inside ? entry.color + entry.delta * frac[i] : get(Color(pos[i]))) * tint;
+		}
+	}
+
+	// Maps each channel of count colors through the same channel of the
+	// gradient, so e.g. red only picks from the reds of the stops. Needs
+	// the table, in and out may be the same.
+	void getChannels(const Color* in, int count, Color tint, Color* out) const {
+		float pos[Image::SPAN_SIZE], value[Image::SPAN_SIZE];
+		for (int c = 0; c < 3; ++c) {
+			for (int i = 0; i < count; ++i)
+				pos[i] = in[i].v[c];
+			lookupTable(&channelTables[c][0], TABLE_SIZE, pos, count, value);
+			for (int i = 0; i < count; ++i) {
+				if (!(pos[i] >= 0.f && pos[i] <= 1.f))
+					value[i] = get(Color(pos[i])).v[c];
+				out[i].v[c] = value[i] * tint.v[c];
+			}
+		}
+	}
+
+	static const int TABLE_SIZE = 1024;
+
+	struct TableEntry { Color color, delta; };
+
 	std::vector<GradientPoint> points;
+	std::vector<TableEntry> table;
+	std::vector<float> channelTables[3]; // Planar copy of the table
+};
+
+
+// Calls kernel with the functor of the given composite operator, which
+// gives every built-in command an inner loop specialized for each operator
+template<typename Kernel>
+void dispatch(OpType type, Kernel& kernel) {
+	switch (type) {
+		case OP_SET: kernel(OpSet()); break;
+		case OP_ADD: kernel(OpAdd()); break;
+		case OP_SUB: kernel(OpSub()); break;
+		case OP_MUL: kernel(OpMul()); break;
+		case OP_DIV: kernel(OpDiv()); break;
+		case OP_MIN: kernel(OpMin()); break;
+		case OP_MAX: kernel(OpMax()); break;
+	}
+}
+
+template<typename GenFunc>
+struct CompositeKernel {
+	Image& dst;
+	GenFunc func;
+	ExecutionMode mode;
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) { dst.composite(func, op, mode); }
+};
+
+template<typename FilterFunc>
+struct FilterKernel {
+	Image& dst;
+	FilterFunc func;
+	ExecutionMode mode;
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) { dst.filter(func, op, mode); }
+};
+
+template<typename SpanFunc>
+struct CompositeSpanKernel {
+	Image& dst;
+	SpanFunc func;
+	ExecutionMode mode;
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) { dst.compositeSpan(func, op, mode); }
 };
 
+struct CompositeLineKernel {
+	Image& dst;
+	const std::vector<Color>& line;
 
-std::map<std::string, CommandFunction> s_cmds = {
-	{ "const", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	template<typename OpFunc>
+	void operator()(OpFunc op) { dst.compositeLine(line, op); }
+};
+
+struct CompositeColumnKernel {
+	Image& dst;
+	const std::vector<Color>& column;
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) { dst.compositeColumn(column, op); }
+};
+
+template<typename GenFunc>
+void composite(Image& dst, GenFunc func, const Op& op, ExecutionMode mode = EXEC_PARALLEL) {
+	CompositeKernel<GenFunc> kernel = { dst, func, mode };
+	dispatch(op.type, kernel);
+}
+
+template<typename SpanFunc>
+void compositeSpan(Image& dst, SpanFunc func, const Op& op, ExecutionMode mode = EXEC_PARALLEL) {
+	CompositeSpanKernel<SpanFunc> kernel = { dst, func, mode };
+	dispatch(op.type, kernel);
+}
+
+// Generators that only depend on x or y are evaluated once per column or
+// row, and the colors broadcast
+void compositeLine(Image& dst, const std::vector<Color>& line, const Op& op) {
+	CompositeLineKernel kernel = { dst, line };
+	dispatch(op.type, kernel);
+}
+
+void compositeColumn(Image& dst, const std::vector<Color>& column, const Op& op) {
+	CompositeColumnKernel kernel = { dst, column };
+	dispatch(op.type, kernel);
+}
+
+// Shapes are zero outside, so adding or subtracting them leaves the pixels
+// there as they are and only their region needs to be visited. Other
+// operators change those pixels too (min and max when they are positive
+// or negative), those visit the whole image.
+template<typename RangeFunc, typename SpanFunc>
+void compositeShape(Image& dst, int top, int bottom, RangeFunc range, SpanFunc func, const Op& op) {
+	if (op.type == OP_ADD)
+		dst.compositeRegion(top, bottom, range, func, OpAdd());
+	else if (op.type == OP_SUB)
+		dst.compositeRegion(top, bottom, range, func, OpSub());
+	else compositeSpan(dst, func, op);
+}
+
+template<typename FilterFunc>
+void filter(Image& dst, FilterFunc func, const Op& op, ExecutionMode mode = EXEC_PARALLEL) {
+	FilterKernel<FilterFunc> kernel = { dst, func, mode };
+	dispatch(op.type, kernel);
+}
+
+// "sin" combines its x and y waves with the composite operator itself
+struct SinKernel {
+	Image& dst;
+	vec2 freq;
+	vec2 offset;
+	Color tint;
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) {
+		vec2 freq = this->freq, offset = this->offset;
+		Color tint = this->tint;
+		std::vector<Color> sx(dst.w);
+		for (int x = 0; x < dst.w; ++x)
+			sx[x] = tint * std::sin((x + offset.x) * freq.x);
+		dst.compositeSpan([=](int y, int x0, int count, Color* out) {
+			Color sy = tint * std::sin((y + offset.y) * freq.y);
+			for (int i = 0; i < count; ++i)
+				out[i] = op(sx[x0 + i], sy);
+		}, op);
+	}
+};
+
+// Separable box blur with a running sum, so that the cost per pixel does
+// not depend on the radius. Each pass works on a scratch copy of one row
+// or column instead of a copy of the whole image.
+struct BoxBlurKernel {
+	Image& dst;
+	int rx, ry;
+	Color tint;
+
+	// Blurs line[0 ... count) in place, clamping at both ends, and combines
+	// the result with the original values. pad needs count + 2 * r colors.
+	template<typename OpFunc>
+	static void blurLine(Color* line, int count, int r, Color scale, Color* pad, OpFunc op) {
+		std::fill(pad, pad + r, line[0]);
+		std::copy(line, line + count, pad + r);
+		std::fill(pad + r + count, pad + count + r + r, line[count - 1]);
+		Color sum;
+		for (int i = 0; i < r + r; ++i)
+			sum += pad[i];
+		for (int i = 0; i < count; ++i) {
+			sum += pad[i + r + r];
+			line[i] = op(pad[i + r], sum * scale);
+			sum -= pad[i];
+		}
+	}
+
+	template<typename OpFunc>
+	void operator()(OpFunc op) {
+		Image& dst = this->dst;
+		int rx = this->rx, ry = this->ry;
+		if (rx > 0) {
+			Color scale = tint / float(rx + rx + 1);
+			dst.forRows([=, &dst](int y0, int y1) {
+				std::vector<Color> line(dst.w), pad(dst.w + rx + rx);
+				for (int y = y0; y < y1; ++y) {
+					dst.loadSpan(y, 0, dst.w, &line[0]);
+					blurLine(&line[0], dst.w, rx, scale, &pad[0], op);
+					dst.storeSpan(y, 0, dst.w, &line[0]);
+				}
+			});
+		}
+		if (ry > 0) {
+			// Strips of columns walked from top to bottom, so that memory is read
+			// row by row and the running sums of all the columns of a strip are
+			// updated together. Rows below the current one are still unmodified,
+			// only the last ry + 1 original rows of the strip need to be kept.
+			Color scale = tint / float(ry + ry + 1);
+			int strips = (dst.w + STRIP_WIDTH - 1) / STRIP_WIDTH;
+			ParallelFor(strips, [=, &dst](int s0, int s1) {
+				const int h = dst.h;
+				std::vector<Color> ring((ry + 1) * STRIP_WIDTH);
+				Color top[STRIP_WIDTH], next[STRIP_WIDTH], sum[STRIP_WIDTH], out[STRIP_WIDTH];
+				for (int s = s0; s < s1; ++s) {
+					int x0 = s * STRIP_WIDTH;
+					int n = min(STRIP_WIDTH, dst.w - x0);
+					dst.loadSpan(0, x0, n, top);
+					for (int i = 0; i < n; ++i)
+						sum[i] = top[i] * float(ry);
+					for (int y = 0; y < ry; ++y) {
+						dst.loadSpan(min(y, h - 1), x0, n, next);
+						for (int i = 0; i < n; ++i)
+							sum[i] += next[i];
+					}
+					for (int y = 0; y < h; ++y) {
+						Color* center = &ring[y % (ry + 1) * n];
+						const Color* first = y >= ry ? &ring[(y - ry) % (ry + 1) * n] : top;
+						dst.loadSpan(y, x0, n, center);
+						dst.loadSpan(min(y + ry, h - 1), x0, n, next);
+						for (int i = 0; i < n; ++i) {
+							sum[i] += next[i];
+							out[i] = op(center[i], sum[i] * scale);
+							sum[i] -= first[i];
+						}
+						dst.storeSpan(y, x0, n, out);
+					}
+				}
+			});
+		}
+	}
+
+	static const int STRIP_WIDTH = 64;
+};
+
+std::map<std::string, OpCommand> s_cmds = {
+	{ "const", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Color tint = parseColor("tint", params);
-		dst.composite([tint](int, int) {
-			return tint;
+		compositeSpan(dst, [tint](int, int, int count, Color* out) {
+			std::fill(out, out + count, tint);
 		}, op);
 	}},
-	{ "blend", [](Image& dst, CompositeFunction op, const Json& params, Generator& gen) {
+	{ "blend", [](Image& dst, const Op& op, const Json& params, Generator& gen) {
 		Color tint = parseColor("tint", params);
 		const std::string& name = parseString("other", params);
 		const auto& other = gen.namedImages.find(name);
 		Image target = other != gen.namedImages.end() ? other->second : dst;
 		float alpha = parseFloat("alpha", params, 0.5f);
-		dst.composite([tint, alpha, &dst, &target](int x, int y) {
-			auto a = dst.get(x, y);
-			auto b = target.get(x, y);
-			return mix(a, b, alpha) * tint;
+		compositeSpan(dst, [tint, alpha, &dst, &target](int y, int x0, int count, Color* out) {
+			Color b[Image::SPAN_SIZE];
+			dst.loadSpan(y, x0, count, out);
+			target.loadSpan(y, x0, count, b);
+			for (int i = 0; i < count; ++i)
+				out[i] = mix(out[i], b[i], alpha) * tint;
 		}, op);
 	}},
-	{ "noise", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "noise", [](Image& dst, const Op& op, const Json& params, Generator& gen) {
+		// Read as an integer, a float would merge seeds above 2^24. Negative
+		// ones wrap around, so -1 is the same as 4294967295.
+		double seedParam = clamp(params["seed"].number_value(), -2147483648.0, 4294967295.0);
+		uint seed = uint(int64_t(seedParam));
+		uint stream = gen.opIndex;
 		Color tint = parseColor("tint", params);
-		dst.composite([tint](int, int) {
-			return Color(rnd()) * tint;
+		compositeSpan(dst, [seed, stream, tint](int y, int x0, int count, Color* out) {
+			float n[Image::SPAN_SIZE];
+			random(seed, stream, y, x0, count, n);
+			for (int i = 0; i < count; ++i)
+				out[i] = Color(n[i]) * tint;
 		}, op);
 	}},
-	{ "simplex", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "simplex", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 freq = parseVec2("freq", params, vec2(1.f));
 		vec2 offset = parseVec2("offset", params, vec2(0.f));
 		Color tint = parseColor("tint", params);
-		dst.composite([freq, offset, tint](int x, int y) {
-			return Color(simplex((vec2(x, y) + offset) * freq) * 0.5f + 0.5f) * tint;
+		compositeSpan(dst, [freq, offset, tint](int y, int x0, int count, Color* out) {
+			float px[Image::SPAN_SIZE], py[Image::SPAN_SIZE], n[Image::SPAN_SIZE];
+			for (int i = 0; i < count; ++i) {
+				px[i] = (x0 + i + offset.x) * freq.x;
+				py[i] = (y + offset.y) * freq.y;
+			}
+			simplex2(px, py, count, n);
+			for (int i = 0; i < count; ++i)
+				out[i] = Color(n[i] * 0.5f + 0.5f) * tint;
 		}, op);
 	}},
-	{ "perlin", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "perlin", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 freq = parseVec2("freq", params, vec2(1.f));
 		vec2 offset = parseVec2("offset", params, vec2(0.f));
 		vec2 period = vec2(dst.w, dst.h) * freq;
 		Color tint = parseColor("tint", params);
-		dst.composite([freq, offset, period, tint](int x, int y) {
-			return Color(perlin((vec2(x, y) + offset) * freq, period) * 0.5f + 0.5f) * tint;
+		compositeSpan(dst, [freq, offset, period, tint](int y, int x0, int count, Color* out) {
+			float px[Image::SPAN_SIZE], py[Image::SPAN_SIZE], n[Image::SPAN_SIZE];
+			for (int i = 0; i < count; ++i) {
+				px[i] = (x0 + i + offset.x) * freq.x;
+				py[i] = (y + offset.y) * freq.y;
+			}
+			perlin2(px, py, count, n, period.x, period.y);
+			for (int i = 0; i < count; ++i)
+				out[i] = Color(n[i] * 0.5f + 0.5f) * tint;
 		}, op);
 	}},
-	{ "fbm", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "fbm", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 freq = parseVec2("freq", params, vec2(1.f));
 		vec2 offset = parseVec2("offset", params, vec2(0.f));
 		float octaves = parseFloat("octaves", params, 1.f);
 		float persistence = parseFloat("persistence", params, 0.5f);
 		float lacunarity = parseFloat("lacunarity", params, 2.0f);
 		Color tint = parseColor("tint", params);
-		dst.composite([=](int x, int y) {
-			float c = 0.0f;
+		compositeSpan(dst, [=](int y, int x0, int count, Color* out) {
+			// Octave by octave over the whole span, so each octave is one SIMD noise call
+			float px[Image::SPAN_SIZE], py[Image::SPAN_SIZE], n[Image::SPAN_SIZE], c[Image::SPAN_SIZE];
+			std::fill(c, c + count, 0.f);
 			float amplitude = 1.0f;
 			vec2 f = freq;
-			vec2 pos = vec2(x, y) + offset;
-			for (int i = 0; i < octaves; ++i) {
-				c += (perlin(pos * f)) * amplitude;
+			for (int o = 0; o < octaves; ++o) {
+				for (int i = 0; i < count; ++i) {
+					px[i] = (x0 + i + offset.x) * f.x;
+					py[i] = (y + offset.y) * f.y;
+				}
+				perlin2(px, py, count, n);
+				for (int i = 0; i < count; ++i)
+					c[i] += n[i] * amplitude;
 				amplitude *= persistence;
 				f *= lacunarity;
 			}
-			return Color(c * 0.5f + 0.5f) * tint;
+			for (int i = 0; i < count; ++i)
+				out[i] = Color(c[i] * 0.5f + 0.5f) * tint;
 		}, op);
 	}},
-	{ "turbulence", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "turbulence", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float s = parseFloat("size", params, 1.f) * min(dst.w, dst.h);
 		Color tint = parseColor("tint", params);
-		dst.composite([=](int x, int y) {
-			float value = 0;
+		compositeSpan(dst, [=](int y, int x0, int count, Color* out) {
+			float px[Image::SPAN_SIZE], py[Image::SPAN_SIZE], n[Image::SPAN_SIZE], value[Image::SPAN_SIZE];
+			std::fill(value, value + count, 0.f);
 			float size = s;
 			while (size >= 1.f) {
-				value += perlin(vec2(x / size, y / size)) * size;
+				for (int i = 0; i < count; ++i) {
+					px[i] = (x0 + i) / size;
+					py[i] = y / size;
+				}
+				perlin2(px, py, count, n);
+				for (int i = 0; i < count; ++i)
+					value[i] += n[i] * size;
 				size *= 0.5f;
 			}
-			return Color(value / s * 0.5f + 0.5f) * tint;
+			for (int i = 0; i < count; ++i)
+				out[i] = Color(value[i] / s * 0.5f + 0.5f) * tint;
 		}, op);
 	}},
-	{ "pow", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "pow", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float density = 1.f - params["density"].number_value();
 		float sharpness = params["sharpness"].number_value();
 		Color tint = parseColor("tint", params);
-		dst.filter([density, sharpness, tint](int, int, Color color) {
+		filter(dst, [density, sharpness, tint](int, int, Color color) {
 			Color c = max(color - density, Color(0.f));
 			Color p = { std::pow(sharpness, c.x), std::pow(sharpness, c.y), std::pow(sharpness, c.z) };
 			return (Color(1.f) - p) * tint;
 		}, op);
 	}},
-	{ "inv", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "inv", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Color tint = parseColor("tint", params);
-		dst.filter([tint](int, int, Color color) {
+		filter(dst, [tint](int, int, Color color) {
 			return (Color(1.f) - color) * tint;
 		}, op);
 	}},
-	{ "clamp", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "clamp", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Color tint = parseColor("tint", params);
-		dst.filter([tint](int, int, Color color) {
+		filter(dst, [tint](int, int, Color color) {
 			return saturate(color * tint);
 		}, op);
 	}},
-	{ "pixelate", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "pixelate", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Image src = dst;
 		vec2 size = parseVec2("size", params, vec2(2, 2));
 		Color tint = parseColor("tint", params);
-		dst.composite([=, &src](int x, int y) {
-			int s = size.x * int(x / size.x);
+		compositeSpan(dst, [=, &src](int y, int x0, int count, Color* out) {
 			int t = size.y * int(y / size.y);
-			return src.get(s, t) * tint;
+			for (int i = 0; i < count; ++i) {
+				int s = size.x * int((x0 + i) / size.x);
+				out[i] = src.get(s, t) * tint;
+			}
 		}, op);
 	}},
-	{ "gradientmap", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "gradientmap", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Color tint = parseColor("tint", params);
+		bool perChannel = params["perchannel"].bool_value();
 		ColorInterpolator interp(params);
-		dst.filter([&](int, int, Color color) {
-			return interp.get(color) * tint;
+		interp.buildTable();
+		compositeSpan(dst, [=, &dst](int y, int x0, int count, Color* out) {
+			float pos[Image::SPAN_SIZE];
+			dst.loadSpan(y, x0, count, out);
+			if (perChannel) {
+				interp.getChannels(out, count, tint, out);
+				return;
+			}
+			for (int i = 0; i < count; ++i)
+				pos[i] = out[i].r;
+			interp.get(pos, count, tint, out);
 		}, op);
 	}},
-	{ "gradientx", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "gradientx", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float w = dst.w;
 		Color tint = parseColor("tint", params);
 		ColorInterpolator interp(params);
-		dst.composite([=, &interp](int x, int) {
-			return interp.get(Color(x / w)) * tint;
-		}, op);
+		std::vector<Color> line(dst.w);
+		for (int x = 0; x < dst.w; ++x)
+			line[x] = interp.get(Color(x / w)) * tint;
+		compositeLine(dst, line, op);
 	}},
-	{ "gradienty", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "gradienty", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float h = dst.h;
 		Color tint = parseColor("tint", params);
 		ColorInterpolator interp(params);
-		dst.composite([=, &interp](int, int y) {
-			return interp.get(Color(y / h)) * tint;
-		}, op);
+		std::vector<Color> column(dst.h);
+		for (int y = 0; y < dst.h; ++y)
+			column[y] = interp.get(Color(y / h)) * tint;
+		compositeColumn(dst, column, op);
 	}},
-	{ "gradientr", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "gradientr", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 pos = parseVec2("pos", params, vec2(dst.w * 0.5f, dst.h * 0.5f));
 		float r = parseFloat("radius", params, max(dst.w * 0.5f, dst.h * 0.5f));
 		Color tint = parseColor("tint", params);
 		ColorInterpolator interp(params);
-		dst.composite([=, &interp](int x, int y) {
-			float rpos = clamp(distance(pos, vec2(x, y)) / r, 0.f, 1.f);
-			return interp.get(Color(rpos)) * tint;
+		interp.buildTable();
+		compositeSpan(dst, [=](int y, int x0, int count, Color* out) {
+			float rpos[Image::SPAN_SIZE];
+			float dy = y - pos.y;
+			for (int i = 0; i < count; ++i) {
+				float dx = x0 + i - pos.x;
+				rpos[i] = clamp(std::sqrt(dx * dx + dy * dy) / r, 0.f, 1.f);
+			}
+			interp.get(rpos, count, tint, out);
 		}, op);
 	}},
-	{ "boxblur", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
-		Image src = dst;
+	{ "boxblur", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 radius = parseVec2("radius", params, vec2(1, 1));
-		vec2 mult = vec2(1, 1) / (radius + radius + vec2(1, 1));
-		Color tint = parseColor("tint", params);
-		if (radius.x > 0) {
-			dst.composite([=, &src](int x, int y) {
-				Color accum;
-				int start = x - radius.x;
-				int end = x + radius.x;
-				for (int i = start; i <= end; ++i)
-					accum += src.getClamp(i, y);
-				return accum * mult.x * tint;
-			}, op);
-			if (radius.y > 0)
-				src = dst;
-		}
-		if (radius.y > 0) {
-			dst.composite([=, &src](int x, int y) {
-				Color accum;
-				int start = y - radius.y;
-				int end = y + radius.y;
-				for (int i = start; i <= end; ++i)
-					accum += src.getClamp(x, i);
-				return accum * mult.y * tint;
-			}, op);
-		}
+		BoxBlurKernel kernel = { dst, int(radius.x), int(radius.y), parseColor("tint", params) };
+		dispatch(op.type, kernel);
 	}},
-	{ "sin", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "sin", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 freq = parseVec2("freq", params, vec2(1.f)) * PI;
 		vec2 offset = parseVec2("offset", params, vec2(0.f));
 		Color tint = parseColor("tint", params);
-		dst.composite([=](int x, int y) {
-			vec2 s = (vec2(x, y) + offset) * freq;
-			return op(tint * std::sin(s.x), tint * std::sin(s.y));
-		}, op);
+		SinKernel kernel = { dst, freq, offset, tint };
+		dispatch(op.type, kernel);
 	}},
-	{ "sinx", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "sinx", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float freq = params["freq"].number_value() * PI;
 		float offset = params["offset"].number_value();
 		Color tint = parseColor("tint", params);
-		dst.composite([=](int x, int) {
-			return tint * std::sin((x + offset) * freq);
-		}, op);
+		std::vector<Color> line(dst.w);
+		for (int x = 0; x < dst.w; ++x)
+			line[x] = tint * std::sin((x + offset) * freq);
+		compositeLine(dst, line, op);
 	}},
-	{ "siny", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "siny", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float freq = params["freq"].number_value() * PI;
 		float offset = params["offset"].number_value();
 		Color tint = parseColor("tint", params);
-		dst.composite([=](int, int y) {
-			return tint * std::sin((y + offset) * freq);
-		}, op);
+		std::vector<Color> column(dst.h);
+		for (int y = 0; y < dst.h; ++y)
+			column[y] = tint * std::sin((y + offset) * freq);
+		compositeColumn(dst, column, op);
 	}},
-	{ "or", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "or", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float w = dst.w;
 		Color tint = parseColor("tint", params);
-		dst.composite([w, tint](int x, int y) {
-			return tint * ((x | y) / w);
+		compositeSpan(dst, [w, tint](int y, int x0, int count, Color* out) {
+			for (int i = 0; i < count; ++i)
+				out[i] = tint * (((x0 + i) | y) / w);
 		}, op);
 	}},
-	{ "xor", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "xor", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		float w = dst.w;
 		Color tint = parseColor("tint", params);
-		dst.composite([w, tint](int x, int y) {
-			return tint * ((x ^ y) / w);
+		compositeSpan(dst, [w, tint](int y, int x0, int count, Color* out) {
+			for (int i = 0; i < count; ++i)
+				out[i] = tint * (((x0 + i) ^ y) / w);
 		}, op);
 	}},
-	{ "rect", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "rect", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 pos = parseVec2("pos", params);
 		vec2 size = parseVec2("size", params);
 		Color tint = parseColor("tint", params);
-		dst.composite([pos, size, tint](int x, int y) {
-			float c = x >= pos.x && x < pos.x + size.x && y >= pos.y && y < pos.y + size.y ? 1.f : 0.f;
-			return Color(c) * tint;
+		// Integer coordinates from ceil(pos) up to but not including
+		// ceil(pos + size) are inside, clamped so they fit an int
+		int top = clamp(std::ceil(pos.y), 0.f, float(dst.h));
+		int bottom = clamp(std::ceil(pos.y + size.y), 0.f, float(dst.h));
+		int left = clamp(std::ceil(pos.x), 0.f, float(dst.w));
+		int right = clamp(std::ceil(pos.x + size.x), 0.f, float(dst.w));
+		compositeShape(dst, top, bottom, [left, right](int, int& x0, int& x1) {
+			x0 = left;
+			x1 = right;
+		}, [pos, size, tint](int y, int x0, int count, Color* out) {
+			if (y < pos.y || y >= pos.y + size.y) {
+				std::fill(out, out + count, Color(0.f));
+				return;
+			}
+			for (int i = 0; i < count; ++i) {
+				int x = x0 + i;
+				float c = x >= pos.x && x < pos.x + size.x ? 1.f : 0.f;
+				out[i] = Color(c) * tint;
+			}
 		}, op);
 	}},
-	{ "circle", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "circle", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		vec2 pos = parseVec2("pos", params, vec2(dst.w * 0.5f, dst.h * 0.5f));
 		float r = parseFloat("radius", params, max(dst.w * 0.5f, dst.h * 0.5f));
 		Color tint = parseColor("tint", params);
-		dst.composite([pos, r, tint](int x, int y) {
-			float c = distance(pos, vec2(x, y)) <= r ? 1.f : 0.f;
-			return Color(c) * tint;
+		// Scanline extents of the circle, a pixel wider on both sides so that
+		// the test below decides the pixels on the edge exactly as before
+		int top = r >= 0.f ? clamp(std::floor(pos.y - r) - 1.f, 0.f, float(dst.h)) : 0;
+		int bottom = r >= 0.f ? clamp(std::floor(pos.y + r) + 2.f, 0.f, float(dst.h)) : 0;
+		int w = dst.w;
+		compositeShape(dst, top, bottom, [pos, r, w](int y, int& x0, int& x1) {
+			float dy = y - pos.y;
+			float e = std::sqrt(max(r * r - dy * dy, 0.f));
+			x0 = clamp(std::floor(pos.x - e) - 1.f, 0.f, float(w));
+			x1 = clamp(std::floor(pos.x + e) + 2.f, 0.f, float(w));
+		}, [pos, r, tint](int y, int x0, int count, Color* out) {
+			float dy = y - pos.y;
+			for (int i = 0; i < count; ++i) {
+				float dx = x0 + i - pos.x;
+				float c = std::sqrt(dx * dx + dy * dy) <= r ? 1.f : 0.f;
+				out[i] = Color(c) * tint;
+			}
 		}, op);
 	}},
-	{ "calc", [](Image& dst, CompositeFunction op, const Json& params, Generator&) {
+	{ "calc", [](Image& dst, const Op& op, const Json& params, Generator&) {
 		Color tint = parseColor("tint", params);
-		double w = dst.w, h = dst.h;
 		const Json& exprParam = params["expr"];
-		if (exprParam.is_string()) {
-			calc::MathExpression expr(exprParam.string_value());
-			expr.setVar('w', w);
-			expr.setVar('h', h);
-			dst.composite([=, &expr](int x, int y) {
-				expr.setVar('x', x);
-				expr.setVar('y', y);
-				return Color(expr.eval()) * tint;
-			}, op);
-		} else if (exprParam.is_array()) {
-			calc::MathExpression r(exprParam.array_items()[0].string_value());
-			calc::MathExpression g(exprParam.array_items()[1].string_value());
-			calc::MathExpression b(exprParam.array_items()[2].string_value());
-			r.setVar('w', w); g.setVar('w', w); b.setVar('w', w);
-			r.setVar('h', h); g.setVar('h', h); b.setVar('h', h);
-			dst.composite([=, &r, &g, &b](int x, int y) {
-				r.setVar('x', x); g.setVar('x', x); b.setVar('x', x);
-				r.setVar('y', y); g.setVar('y', y); b.setVar('y', y);
-				return Color(r.eval(), g.eval(), b.eval()) * tint;
-			}, op);
+		std::vector<std::string> exprs;
+		if (exprParam.is_string())
+			exprs.push_back(exprParam.string_value());
+		else if (exprParam.is_array()) {
+			for (int i = 0; i < 3; ++i)
+				exprs.push_back(exprParam.array_items()[i].string_value());
+		} else return;
+		// RGB is one program for the channels, so what they share runs once.
+		// Single precision is plenty for colors and runs twice as wide.
+		calc::MathExpression expr(exprs);
+		if (expr.getStatus() != calc::OK) {
+			// The shared program only knows the first error, so find which one it was
+			for (const std::string& str : exprs) {
+				calc::MathExpression single(str);
+				if (single.getStatus() != calc::OK)
+					reportExpression(str, single.getStatus());
+			}
+			return;
 		}
+		expr.hoist("wh", "y");
+		expr.setVar('w', dst.w);
+		expr.setVar('h', dst.h);
+		expr.compileNative('x', calc::PRECISION_FLOAT);
+		// The compiled expression is shared, each thread evaluates it in its own context
+		std::vector<calc::MathContext> contexts(GetThreadCount(), calc::MathContext(expr));
+		const int ySlot = expr.getSlot('y');
+		const bool rgb = exprs.size() == 3;
+		compositeSpan(dst, [=, &contexts](int y, int x0, int count, Color* out) {
+			calc::MathContext& context = contexts[GetThreadIndex()];
+			float xs[Image::SPAN_SIZE], v[Image::SPAN_SIZE * 3];
+			for (int i = 0; i < count; ++i)
+				xs[i] = x0 + i;
+			if (ySlot >= 0)
+				context.setSlot(ySlot, y);
+			context.eval('x', xs, count, v);
+			for (int i = 0; i < count; ++i)
+				out[i] = (rgb ? Color(v[i], v[count + i], v[count * 2 + i]) : Color(v[i])) * tint;
+		}, op);
 	}},
 };
 
+// Registered commands get their parameters as written
+static std::set<std::string> s_registered;
+
+void RegisterCommand(const std::string& name, CommandFunction cmd) {
+	s_registered.insert(name);
+	s_cmds[name] = [cmd](Image& dst, const Op& op, const Json& params, Generator& gen) {
+		cmd(dst, op.op, params, gen);
+	};
+}
+
+// Noise functions for expressions, in [0, 1] like the noise commands. The
+// float kernels run the SIMD span versions, a block at a time so that
+// kernels may write over their arguments.
+static const int EXPR_BLOCK = calc::MathExpression::BLOCK_SIZE;
+
+static void exprPerlin1(const float* in, int, int count, float* out) {
+	static const float zeros[EXPR_BLOCK] = {};
+	for (int start = 0; start < count; start += EXPR_BLOCK) {
+		int len = min(EXPR_BLOCK, count - start);
+		perlin2(in + start, zeros, len, out + start);
+	}
+	for (int i = 0; i < count; ++i)
+		out[i] = out[i] * 0.5f + 0.5f;
+}
+
+static void exprPerlin2(const float* in, int stride, int count, float* out) {
+	perlin2(in, in + stride, count, out);
+	for (int i = 0; i < count; ++i)
+		out[i] = out[i] * 0.5f + 0.5f;
+}
+
+static void exprPerlin3(const float* in, int stride, int count, float* out) {
+	perlin3(in, in + stride, in + stride * 2, count, out);
+	for (int i = 0; i < count; ++i)
+		out[i] = out[i] * 0.5f + 0.5f;
+}
+
+static void exprSimplex(const float* in, int stride, int count, float* out) {
+	simplex2(in, in + stride, count, out);
+	for (int i = 0; i < count; ++i)
+		out[i] = out[i] * 0.5f + 0.5f;
+}
+
+// fbm(x, y, octaves) with the defaults of the fbm command
+static void exprFbm(const float* in, int stride, int count, float* out) {
+	for (int start = 0; start < count; start += EXPR_BLOCK) {
+		const int len = min(EXPR_BLOCK, count - start);
+		const float* x = in + start;
+		const float* y = in + stride + start;
+		const float* octaves = in + stride * 2 + start;
+		float px[EXPR_BLOCK], py[EXPR_BLOCK], n[EXPR_BLOCK], c[EXPR_BLOCK] = {};
+		float maxOctaves = *std::max_element(octaves, octaves + len);
+		float amplitude = 1.f, f = 1.f;
+		for (int o = 0; o < maxOctaves; ++o) {
+			for (int i = 0; i < len; ++i) {
+				px[i] = x[i] * f;
+				py[i] = y[i] * f;
+			}
+			perlin2(px, py, len, n);
+			for (int i = 0; i < len; ++i)
+				c[i] += o < octaves[i] ? n[i] * amplitude : 0.f;
+			amplitude *= 0.5f;
+			f *= 2.f;
+		}
+		for (int i = 0; i < len; ++i)
+			out[start + i] = c[i] * 0.5f + 0.5f;
+	}
+}
+
+// Double versions through the float kernels
+template<calc::BatchFloatFunc F, int ARGS>
+static void exprBatch(const double* in, int stride, int count, double* out) {
+	float args[ARGS * EXPR_BLOCK], res[EXPR_BLOCK];
+	for (int start = 0; start < count; start += EXPR_BLOCK) {
+		const int len = min(EXPR_BLOCK, count - start);
+		for (int j = 0; j < ARGS; ++j) {
+			for (int i = 0; i < len; ++i)
+				args[j * EXPR_BLOCK + i] = in[j * stride + start + i];
+		}
+		F(args, EXPR_BLOCK, len, res);
+		for (int i = 0; i < len; ++i)
+			out[start + i] = res[i];
+	}
+}
+
+template<calc::BatchFloatFunc F, int ARGS>
+static double exprScalar(const double* args) {
+	float a[ARGS], res;
+	for (int j = 0; j < ARGS; ++j)
+		a[j] = args[j];
+	F(a, 1, 1, &res);
+	return res;
+}
+
+template<calc::BatchFloatFunc F, int ARGS>
+static calc::Function exprFunction(const char* name) {
+	calc::Function f = { name, ARGS, exprScalar<F, ARGS>, exprBatch<F, ARGS>, F, true };
+	return f;
+}
+
 void InitMathParser() {
-	calc::MathExpression::funcs.push_back({"perlin", [](double x)->double{ return perlin(vec2(x, 0.f)) * 0.5f + 0.5f; }});
+	std::deque<calc::Function>& funcs = calc::MathExpression::funcs;
+	funcs.push_back(exprFunction<exprPerlin1, 1>("perlin"));
+	funcs.push_back(exprFunction<exprPerlin2, 2>("perlin"));
+	funcs.push_back(exprFunction<exprPerlin3, 3>("perlin"));
+	funcs.push_back(exprFunction<exprSimplex, 2>("simplex"));
+	funcs.push_back(exprFunction<exprFbm, 3>("fbm"));
 }
 
+// Ops that only depend on (x, y, current color) and don't keep references to
+// locals, so they can be queued and fused into one pass over the image
+static const std::set<std::string> s_pointwise = {
+	"const", "noise", "sin", "sinx", "siny", "or", "xor", "rect", "circle",
+	"simplex", "perlin", "fbm", "turbulence", "pow", "inv", "clamp",
+	"gradientmap", "gradientx", "gradienty", "gradientr"
+};
+
 // Generator class
 
 static const std::vector<Op> s_ops = {
-	{ "set", [](Color  , Color b) { return b; } },
-	{ "add", [](Color a, Color b) { return a + b; } },
-	{ "sub", [](Color a, Color b) { return a - b; } },
-	{ "mul", [](Color a, Color b) { return a * b; } },
-	{ "div", [](Color a, Color b) { return a / b; } },
-	{ "min", [](Color a, Color b) { return min(a, b); } },
-	{ "max", [](Color a, Color b) { return max(a, b); } },
+	{ "set", OpSet(), OP_SET },
+	{ "add", OpAdd(), OP_ADD },
+	{ "sub", OpSub(), OP_SUB },
+	{ "mul", OpMul(), OP_MUL },
+	{ "div", OpDiv(), OP_DIV },
+	{ "min", OpMin(), OP_MIN },
+	{ "max", OpMax(), OP_MAX },
 };
 
-void Generator::processCommand(const Json &cmd) {
-	// Check special stuff
+static const Op* findOp(const Json& cmd) {
+	for (const auto& op : s_ops) {
+		if (!cmd[op.name].is_null())
+			return &op;
+	}
+	return nullptr;
+}
+
+// Parameters of the built-in commands that are not numbers or colors
+static const std::set<std::string> s_stringParams = { "other", "expr", "comment" };
+
+// Evaluates the math expressions and parses the hex colors of a parameter,
+// leaving only numbers and arrays of them
+static Json resolveParam(const Json& param) {
+	if (param.is_array()) {
+		Json::array items;
+		for (const auto& item : param.array_items())
+			items.push_back(resolveParam(item));
+		return items;
+	}
+	if (!param.is_string() || param.string_value().empty())
+		return param;
+	const std::string& str = param.string_value();
+	if (str[0] == '#') {
+		Color color = parseColor(param);
+		return Json::array { color.r, color.g, color.b };
+	}
+	return parseExpression(str);
+}
+
+static Json resolveParams(const Json& cmd) {
+	Json::object params;
+	for (const auto& param : cmd.object_items()) {
+		bool keep = s_stringParams.count(param.first);
+		for (const auto& op : s_ops)
+			keep |= param.first == op.name;
+		params[param.first] = keep ? param.second : resolveParam(param.second);
+	}
+	return params;
+}
+
+// Returns false for anything that is neither an op nor a save
+static bool compileStep(const Json& cmd, PlanStep& step) {
 	if (cmd["save"].is_string()) {
-		const std::string& name = cmd["save"].string_value();
-		namedImages[name] = image;
-		return;
+		step = { nullptr, nullptr, Json(), cmd["save"].string_value(), false };
+		return true;
 	}
-	// Check composite operators
-	for (const auto& op : s_ops) {
-		if (!cmd[op.name].is_null()) {
-			const std::string& genFunc = cmd[op.name].string_value();
-			//std::cout << "Applying " << gen << " with " << op.name << std::endl;
-			s_cmds[genFunc](image, op.op, cmd, *this);
-			break;
-		}
+	const Op* op = findOp(cmd);
+	if (!op)
+		return false;
+	const std::string& genFunc = cmd[op->name].string_value();
+	const auto& it = s_cmds.find(genFunc);
+	if (it == s_cmds.end()) {
+		std::cerr << "unknown generator \"" << genFunc << "\"" << std::endl;
+		step = { op, nullptr, cmd, "", false };
+	} else {
+		// A registered command may replace a built-in one, and nothing is
+		// known about what its passes keep references to
+		bool registered = s_registered.count(genFunc) > 0;
+		const Json& params = registered ? cmd : resolveParams(cmd);
+		step = { op, &it->second, params, "", s_pointwise.count(genFunc) && !registered };
+	}
+	return true;
+}
+
+Plan CompilePlan(const Json& cmds) {
+	Plan plan;
+	for (const auto& cmd : cmds.array_items()) {
+		PlanStep step;
+		if (compileStep(cmd, step))
+			plan.push_back(step);
+	}
+	return plan;
+}
+
+void Generator::processCommand(const Json &cmd) {
+	PlanStep step;
+	if (compileStep(cmd, step))
+		runStep(step);
+}
+
+void Generator::processCommands(const Json& cmds) {
+	run(CompilePlan(cmds));
+}
+
+void Generator::run(const Plan& plan) {
+	for (const auto& step : plan) {
+		// Anything that reads neighbouring pixels or copies the image
+		// needs the queued passes to be finished first
+		if (step.pointwise && !image.isFusing())
+			image.beginFusion();
+		else if (!step.pointwise && image.isFusing())
+			image.endFusion();
+		runStep(step);
+	}
+	image.endFusion();
+}
+
+void Generator::runStep(const PlanStep& step) {
+	if (!step.op) {
+		namedImages[step.save] = image;
+		return;
 	}
+	if (step.cmd)
+		(*step.cmd)(image, *step.op, step.params, *this);
+	++opIndex;
 }
 
 // Image class
 
-const std::vector<char> Image::getBytes() const {
-	std::vector<char> bytes;
-	bytes.resize(w * h * channels);
-	int i = 0;
-	for (int y = 0; y < h; ++y) {
+// Rows fused passes process at a time, small enough to stay in L1/L2
+static const int FUSION_BAND_BYTES = 32 * 1024;
+
+void Image::endFusion() {
+	fusing = false;
+	if (fused.empty())
+		return;
+	ExecutionMode mode = EXEC_PARALLEL;
+	for (const auto& pass : fused) {
+		if (pass.mode == EXEC_SERIAL)
+			mode = EXEC_SERIAL;
+	}
+	const int band = max(1, FUSION_BAND_BYTES / int(w * sizeof(Color)));
+	forRows([this, band](int y0, int y1) {
+		for (int y = y0; y < y1; y += band) {
+			int end = min(y + band, y1);
+			for (const auto& pass : fused)
+				pass.func(y, end);
+		}
+	}, mode);
+	fused.clear();
+}
+
+void Image::getRowBytes(int y, char* out, bool swapRB) const {
+	int ri = swapRB ? 2 : 0, bi = swapRB ? 0 : 2;
+	if (layout == LAYOUT_PLANAR) {
+		const float* r = planeRow(0, y);
+		const float* g = planeRow(1, y);
+		const float* b = planeRow(2, y);
+		for (int x = 0; x < w; ++x) {
+			out[x * 3 + ri] = static_cast<unsigned char>(saturate(r[x]) * 255);
+			out[x * 3 + 1] = static_cast<unsigned char>(saturate(g[x]) * 255);
+			out[x * 3 + bi] = static_cast<unsigned char>(saturate(b[x]) * 255);
+		}
+	} else {
+		const Color* pixels = row(y);
 		for (int x = 0; x < w; ++x) {
-			const Color pix = saturate(get(x, y));
-			bytes[i++] = static_cast<unsigned char>(pix.r * 255);
-			bytes[i++] = static_cast<unsigned char>(pix.g * 255);
-			bytes[i++] = static_cast<unsigned char>(pix.b * 255);
+			const Color pix = saturate(pixels[x]);
+			out[x * 3 + ri] = static_cast<unsigned char>(pix.r * 255);
+			out[x * 3 + 1] = static_cast<unsigned char>(pix.g * 255);
+			out[x * 3 + bi] = static_cast<unsigned char>(pix.b * 255);
 		}
 	}
+}
+
+const std::vector<char> Image::getBytes() const {
+	std::vector<char> bytes;
+	bytes.resize(w * h * channels);
+	for (int y = 0; y < h; ++y)
+		getRowBytes(y, &bytes[y * w * channels]);
 	return bytes;
 }
 
@@ -467,16 +1095,9 @@ void Image::writeTGA(const std::string& filepath, bool rleCompress) const {
 		tgaout << static_cast<char>(0x00);  // No special flags
 		std::vector<char> pixbuf;
 		pixbuf.resize(w * h * channels);
-		// Image data
-		int i = 0;
-		for (int y = h-1; y >= 0; --y) {
-			for (int x = 0; x < w; ++x) {
-				const Color pix = saturate(get(x, y));
-				pixbuf[i++] = static_cast<unsigned char>(pix.b * 255);
-				pixbuf[i++] = static_cast<unsigned char>(pix.g * 255);
-				pixbuf[i++] = static_cast<unsigned char>(pix.r * 255);
-			}
-		}
+		// Image data, bottom-up BGR
+		for (int y = h-1; y >= 0; --y)
+			getRowBytes(y, &pixbuf[(h - 1 - y) * w * channels], true);
 		tgaout.write(&pixbuf[0], pixbuf.size());
 	}
 }
@@ -3,10 +3,13 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <algorithm>
 
 #include <json11/json11.hpp>
 
 #include "math.hpp"
+#include "aligned.hpp"
+#include "parallel.hpp"
 
 namespace gentex {
 
@@ -28,18 +31,79 @@ namespace gentex {
 		CommandFunction cmd;
 	};
 
+	// Composite operators as functors, so that the built-in commands can
+	// instantiate their inner loops for each operator
+	struct OpSet { Color operator()(Color  , Color b) const { return b; } };
+	struct OpAdd { Color operator()(Color a, Color b) const { return a + b; } };
+	struct OpSub { Color operator()(Color a, Color b) const { return a - b; } };
+	struct OpMul { Color operator()(Color a, Color b) const { return a * b; } };
+	struct OpDiv { Color operator()(Color a, Color b) const { return a / b; } };
+	struct OpMin { Color operator()(Color a, Color b) const { return min(a, b); } };
+	struct OpMax { Color operator()(Color a, Color b) const { return max(a, b); } };
+
+	enum OpType {
+		OP_SET,
+		OP_ADD,
+		OP_SUB,
+		OP_MUL,
+		OP_DIV,
+		OP_MIN,
+		OP_MAX
+	};
+
 	struct Op {
 		std::string name;
 		CompositeFunction op;
+		OpType type;
+	};
+
+	typedef std::function<void(Image&, const Op&, const Json&, Generator&)> OpCommand;
+
+	// One op of a spec with its command looked up and, for the built-in
+	// commands, its parameter expressions evaluated and colors parsed
+	struct PlanStep {
+		const Op* op; // Null for saving the image
+		const OpCommand* cmd; // Null for unknown generators
+		Json params;
+		std::string save; // Name to save the image as
+		bool pointwise;
+	};
+
+	// The ops of a spec compiled once, to be run any number of times
+	typedef std::vector<PlanStep> Plan;
+
+	// The built-in generators run in parallel. EXEC_SERIAL is for registered
+	// commands that keep state between pixels and must visit them in order.
+	enum ExecutionMode {
+		EXEC_PARALLEL,
+		EXEC_SERIAL
+	};
+
+	enum ImageLayout {
+		LAYOUT_INTERLEAVED, // One Color per pixel
+		LAYOUT_PLANAR       // Separate, aligned and padded R, G and B planes
 	};
 
 	void InitMathParser();
 
+	// Adds a generator usable from specs, overriding a built-in one with the same name
+	void RegisterCommand(const std::string& name, CommandFunction cmd);
+
+	// Compiles an array of ops, reporting unknown generators and malformed
+	// parameters once here instead of on every run
+	Plan CompilePlan(const Json& cmds);
+
 	inline Color saturate(const Color c) { return clamp(c, 0.0f, 1.0f); }
 
 	class Image {
 	public:
-		Image(int w, int h): w(w), h(h), buffer(w * h) { }
+		Image(int w, int h, ImageLayout layout = LAYOUT_INTERLEAVED): w(w), h(h), layout(layout) {
+			if (layout == LAYOUT_PLANAR) {
+				// Pad the rows to whole cache lines so that every row starts aligned
+				stride = (w + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+				planes.resize(channels * stride * h);
+			} else buffer.resize(w * h);
+		}
 		Image() {}
 
 		Color sample(float u, float v) const {
@@ -55,9 +119,51 @@ namespace gentex {
 		}
 
 		Color get(int x, int y) const {
+			if (layout == LAYOUT_PLANAR)
+				return Color(planeRow(0, y)[x], planeRow(1, y)[x], planeRow(2, y)[x]);
 			return buffer[x + y * w];
 		}
 
+		void set(int x, int y, Color color) {
+			if (layout == LAYOUT_PLANAR) {
+				planeRow(0, y)[x] = color.r;
+				planeRow(1, y)[x] = color.g;
+				planeRow(2, y)[x] = color.b;
+			} else buffer[x + y * w] = color;
+		}
+
+		// Row of a single channel, only valid for LAYOUT_PLANAR
+		float* planeRow(int channel, int y) { return &planes[(channel * h + y) * stride]; }
+		const float* planeRow(int channel, int y) const { return &planes[(channel * h + y) * stride]; }
+
+		// Row of pixels, only valid for LAYOUT_INTERLEAVED
+		Color* row(int y) { return &buffer[y * w]; }
+		const Color* row(int y) const { return &buffer[y * w]; }
+
+		// Copy a span of a row to / from a Color array in either layout
+		void loadSpan(int y, int x0, int count, Color* out) const {
+			if (layout == LAYOUT_PLANAR) {
+				const float* r = planeRow(0, y) + x0;
+				const float* g = planeRow(1, y) + x0;
+				const float* b = planeRow(2, y) + x0;
+				for (int i = 0; i < count; ++i)
+					out[i] = Color(r[i], g[i], b[i]);
+			} else std::copy(row(y) + x0, row(y) + x0 + count, out);
+		}
+
+		void storeSpan(int y, int x0, int count, const Color* in) {
+			if (layout == LAYOUT_PLANAR) {
+				float* r = planeRow(0, y) + x0;
+				float* g = planeRow(1, y) + x0;
+				float* b = planeRow(2, y) + x0;
+				for (int i = 0; i < count; ++i) {
+					r[i] = in[i].r;
+					g[i] = in[i].g;
+					b[i] = in[i].b;
+				}
+			} else std::copy(in, in + count, row(y) + x0);
+		}
+
 		Color getClamp(int x, int y) const {
 			return get(clamp(x, 0, w - 1), clamp(y, 0, h - 1));
 		}
@@ -66,30 +172,178 @@ namespace gentex {
 			return get(x % w, y % h);
 		}
 
-		void generate(GeneratorFunction func) {
-			for (int y = 0; y < h; ++y) {
-				for (int x = 0; x < w; ++x) {
-					buffer[y * w + x] = func(x, y);
-				}
+		void forRows(const RangeFunction& func, ExecutionMode mode = EXEC_PARALLEL) {
+			if (fusing) {
+				fused.push_back({ func, mode });
+				return;
 			}
+			if (mode == EXEC_SERIAL)
+				func(0, h);
+			else ParallelFor(h, func);
 		}
 
-		void composite(GeneratorFunction func, CompositeFunction op) {
-			for (int y = 0; y < h; ++y) {
-				for (int x = 0; x < w; ++x) {
-					Color& color = buffer[y * w + x];
-					color = op(color, func(x, y));
+		// While fusing, row passes are queued instead of run. endFusion() then
+		// runs all of them band by band so that each band stays in cache.
+		void beginFusion() { fusing = true; }
+		void endFusion();
+		bool isFusing() const { return fusing; }
+
+		// Calls func(x, y, color) with a modifiable reference to each pixel
+		template<typename PixelFunc>
+		void forPixels(PixelFunc func, ExecutionMode mode = EXEC_PARALLEL) {
+			forRows([=](int y0, int y1) {
+				for (int y = y0; y < y1; ++y) {
+					if (layout == LAYOUT_PLANAR) {
+						float* r = planeRow(0, y);
+						float* g = planeRow(1, y);
+						float* b = planeRow(2, y);
+						for (int x = 0; x < w; ++x) {
+							Color color(r[x], g[x], b[x]);
+							func(x, y, color);
+							r[x] = color.r;
+							g[x] = color.g;
+							b[x] = color.b;
+						}
+					} else {
+						Color* pixels = row(y);
+						for (int x = 0; x < w; ++x)
+							func(x, y, pixels[x]);
+					}
 				}
-			}
+			}, mode);
+		}
+
+		template<typename GenFunc>
+		void generate(GenFunc func, ExecutionMode mode = EXEC_PARALLEL) {
+			forPixels([=](int x, int y, Color& color) {
+				color = func(x, y);
+			}, mode);
+		}
+
+		template<typename GenFunc, typename OpFunc>
+		void composite(GenFunc func, OpFunc op, ExecutionMode mode = EXEC_PARALLEL) {
+			forPixels([=](int x, int y, Color& color) {
+				color = op(color, func(x, y));
+			}, mode);
+		}
+
+		// Maximum number of pixels span generators are asked for at a time
+		static const int SPAN_SIZE = 256;
+
+		// Like composite(), but func(y, x0, count, out) generates a whole span
+		// of a row per call so that per-row work can be done only once
+		template<typename SpanFunc, typename OpFunc>
+		void compositeSpan(SpanFunc func, OpFunc op, ExecutionMode mode = EXEC_PARALLEL) {
+			forRows([=](int y0, int y1) {
+				Color span[SPAN_SIZE];
+				for (int y = y0; y < y1; ++y) {
+					for (int x0 = 0; x0 < w; x0 += SPAN_SIZE) {
+						int count = min(SPAN_SIZE, w - x0);
+						func(y, x0, count, span);
+						compositeRow(y, x0, count, span, op);
+					}
+				}
+			}, mode);
 		}
 
-		void filter(FilterFunction func, CompositeFunction op) {
-			for (int y = 0; y < h; ++y) {
+		// Like compositeSpan(), but only for rows top ... bottom - 1 and in
+		// each the columns x0 ... x1 - 1 that range(y, x0, x1) gives. For
+		// generators and operators that leave the rest of the image as it is.
+		template<typename RangeFunc, typename SpanFunc, typename OpFunc>
+		void compositeRegion(int top, int bottom, RangeFunc range, SpanFunc func, OpFunc op) {
+			forRows([=](int y0, int y1) {
+				Color span[SPAN_SIZE];
+				for (int y = max(y0, top); y < min(y1, bottom); ++y) {
+					int left = 0, right = 0;
+					range(y, left, right);
+					left = max(left, 0);
+					right = min(right, w);
+					for (int x0 = left; x0 < right; x0 += SPAN_SIZE) {
+						int count = min(SPAN_SIZE, right - x0);
+						func(y, x0, count, span);
+						compositeRow(y, x0, count, span, op);
+					}
+				}
+			});
+		}
+
+		// For generators that only depend on x: combines every row with the
+		// same line of w colors
+		template<typename OpFunc>
+		void compositeLine(const std::vector<Color>& line, OpFunc op) {
+			forRows([=](int y0, int y1) {
+				for (int y = y0; y < y1; ++y) {
+					if (layout == LAYOUT_PLANAR) {
+						float* r = planeRow(0, y);
+						float* g = planeRow(1, y);
+						float* b = planeRow(2, y);
+						for (int x = 0; x < w; ++x) {
+							Color color = op(Color(r[x], g[x], b[x]), line[x]);
+							r[x] = color.r;
+							g[x] = color.g;
+							b[x] = color.b;
+						}
+					} else {
+						Color* pixels = row(y);
+						for (int x = 0; x < w; ++x)
+							pixels[x] = op(pixels[x], line[x]);
+					}
+				}
+			});
+		}
+
+		// Setting the same line everywhere is a copy per row
+		void compositeLine(const std::vector<Color>& line, OpSet) {
+			std::vector<float> planar;
+			if (layout == LAYOUT_PLANAR) {
+				planar.resize(channels * w);
 				for (int x = 0; x < w; ++x) {
-					Color& color = buffer[y * w + x];
-					color = op(color, func(x, y, color));
+					planar[x] = line[x].r;
+					planar[w + x] = line[x].g;
+					planar[w + w + x] = line[x].b;
 				}
 			}
+			forRows([=](int y0, int y1) {
+				for (int y = y0; y < y1; ++y) {
+					if (layout == LAYOUT_PLANAR) {
+						for (int c = 0; c < channels; ++c)
+							std::copy(&planar[c * w], &planar[c * w] + w, planeRow(c, y));
+					} else std::copy(line.begin(), line.end(), row(y));
+				}
+			});
+		}
+
+		// For generators that only depend on y: combines row y with the
+		// single color column[y]
+		template<typename OpFunc>
+		void compositeColumn(const std::vector<Color>& column, OpFunc op) {
+			forRows([=](int y0, int y1) {
+				for (int y = y0; y < y1; ++y) {
+					Color c = column[y];
+					if (layout == LAYOUT_PLANAR) {
+						float* r = planeRow(0, y);
+						float* g = planeRow(1, y);
+						float* b = planeRow(2, y);
+						for (int x = 0; x < w; ++x) {
+							Color color = op(Color(r[x], g[x], b[x]), c);
+							r[x] = color.r;
+							g[x] = color.g;
+							b[x] = color.b;
+						}
+					} else {
+						Color* pixels = row(y);
+						for (int x = 0; x < w; ++x)
+							pixels[x] = op(pixels[x], c);
+					}
+				}
+			});
+		}
+
+		template<typename FilterFunc, typename OpFunc>
+		void filter(FilterFunc func, OpFunc op, ExecutionMode mode = EXEC_PARALLEL) {
+			forPixels([=](int x, int y, Color& color) {
+				color = op(color, func(x, y, color));
+			}, mode);
 		}
 
 		void write(const std::string& filepath = "out.png") const;
@@ -97,20 +351,62 @@ namespace gentex {
 		void writePNG(const std::string& filepath = "out.png") const;
 		void writeJPG(const std::string& filepath = "out.jpg", int quality = 95) const;
 		const std::vector<char> getBytes() const;
+		// Converts a row to saturated 8-bit RGB, or BGR when swapRB is set
+		void getRowBytes(int y, char* out, bool swapRB = false) const;
 
 		int w = 0, h = 0;
 		static const int channels = 3; // TODO: Support different channel count, i.e. alpha?
+		ImageLayout layout = LAYOUT_INTERLEAVED;
 		std::vector<Color> buffer;
+		// Planar storage, channel after channel with rows stride floats apart
+		static const int PLANE_ALIGN = 64 / sizeof(float);
+		int stride = 0;
+		std::vector<float, AlignedAllocator<float, 64>> planes;
+
+	private:
+		template<typename OpFunc>
+		void compositeRow(int y, int x0, int count, const Color* span, OpFunc op) {
+			if (layout == LAYOUT_PLANAR) {
+				float* r = planeRow(0, y) + x0;
+				float* g = planeRow(1, y) + x0;
+				float* b = planeRow(2, y) + x0;
+				for (int i = 0; i < count; ++i) {
+					Color color = op(Color(r[i], g[i], b[i]), span[i]);
+					r[i] = color.r;
+					g[i] = color.g;
+					b[i] = color.b;
+				}
+			} else {
+				Color* pixels = row(y) + x0;
+				for (int i = 0; i < count; ++i)
+					pixels[i] = op(pixels[i], span[i]);
+			}
+		}
+
+		struct RowPass {
+			RangeFunction func;
+			ExecutionMode mode;
+		};
+
+		bool fusing = false;
+		std::vector<RowPass> fused;
 	};
 
 	class Generator {
 	public:
-		Generator(int width, int height): image(width, height) { }
+		Generator(int width, int height, ImageLayout layout = LAYOUT_INTERLEAVED): image(width, height, layout) { }
 
 		void processCommand(const Json& cmd);
+		// Like processCommand() for each op in the array, but runs of consecutive
+		// pointwise ops are fused into a single traversal of the image
+		void processCommands(const Json& cmds);
+		// Same for a compiled plan
+		void run(const Plan& plan);
+		void runStep(const PlanStep& step);
 
 		Image image;
 		std::map<std::string, Image> namedImages;
+		uint opIndex = 0; // Number of generator ops processed so far, used to vary noise between ops
 	};
 
 } // namespace
@@ -0,0 +1,431 @@
+#include "noise.hpp"
+
+#define STB_PERLIN_IMPLEMENTATION
+#include "stb/stb_perlin.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace gentex {
+
+namespace {
+
+// stb_perlin's tables widened to 32 bits for SIMD gathers. The 3D gradients
+// are reduced to their x and y components, as z is always 0 in 2D.
+struct PerlinTables {
+	int perm[512];
+	float gradX[512];
+	float gradY[512];
+
+	PerlinTables() {
+		static const float basis[12][2] = {
+			{ 1, 1 }, { -1, 1 }, { 1, -1 }, { -1, -1 },
+			{ 1, 0 }, { -1, 0 }, { 1, 0 }, { -1, 0 },
+			{ 0, 1 }, { 0, -1 }, { 0, 1 }, { 0, -1 }
+		};
+		for (int i = 0; i < 512; ++i) {
+			perm[i] = stb__perlin_randtab[i];
+			gradX[i] = basis[stb__perlin_randtab_grad_idx[i]][0];
+			gradY[i] = basis[stb__perlin_randtab_grad_idx[i]][1];
+		}
+	}
+};
+
+const PerlinTables s_tables;
+
+inline int fastfloor(float a) {
+	int ai = (int)a;
+	return (a < ai) ? ai - 1 : ai;
+}
+
+inline float ease(float a) {
+	return ((a * 6 - 15) * a + 10) * a * a * a;
+}
+
+inline unsigned wrapMask(int wrap) {
+	return (wrap - 1) & 255;
+}
+
+// Skewing factors between the square grid and the simplex (triangle) grid
+const float F2 = 0.36602540378f; // (sqrt(3) - 1) / 2
+const float G2 = 0.21132486540f; // (3 - sqrt(3)) / 6
+// Scales the sum of the corner contributions to [-1, 1]
+const float SIMPLEX_SCALE = 70.f;
+
+inline float simplexCorner(int hash, float x, float y) {
+	float t = 0.5f - x * x - y * y;
+	if (t < 0.f)
+		return 0.f;
+	t *= t;
+	return t * t * (s_tables.gradX[hash] * x + s_tables.gradY[hash] * y);
+}
+
+// Integer hash with good avalanche ("lowbias32" by Chris Wellons)
+inline unsigned hash(unsigned x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline float toUnitFloat(unsigned h) {
+	// Top 24 bits, exactly representable as float
+	return (h >> 8) * (1.f / 16777216.f);
+}
+
+// Mixes a value into a key. Hashing the value before combining keeps keys
+// that differ by less than a row from giving shifted copies of one sequence.
+inline unsigned combine(unsigned key, unsigned value) {
+	return hash(key ^ hash(value));
+}
+
+// Hash of everything but x, shared by the whole row
+inline unsigned rowKey(unsigned seed, unsigned stream, int y) {
+	return combine(combine(hash(seed), stream), y);
+}
+
+#if defined(__AVX2__)
+
+inline __m256i hash(__m256i x) {
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	return x;
+}
+
+inline __m256 toUnitFloat(__m256i h) {
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)), _mm256_set1_ps(1.f / 16777216.f));
+}
+
+inline __m256 ease(__m256 a) {
+	__m256 t = _mm256_sub_ps(_mm256_mul_ps(a, _mm256_set1_ps(6.f)), _mm256_set1_ps(15.f));
+	t = _mm256_add_ps(_mm256_mul_ps(t, a), _mm256_set1_ps(10.f));
+	return _mm256_mul_ps(_mm256_mul_ps(t, a), _mm256_mul_ps(a, a));
+}
+
+inline __m256 lerp(__m256 a, __m256 b, __m256 t) {
+	return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+}
+
+inline __m256 grad(__m256i hash, __m256 x, __m256 y) {
+	__m256 gx = _mm256_i32gather_ps(s_tables.gradX, hash, 4);
+	__m256 gy = _mm256_i32gather_ps(s_tables.gradY, hash, 4);
+	return _mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y));
+}
+
+inline __m256i perm(__m256i index) {
+	return _mm256_i32gather_epi32(s_tables.perm, index, 4);
+}
+
+inline __m256 perlin2(__m256 x, __m256 y, __m256i xMask, __m256i yMask) {
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 onef = _mm256_set1_ps(1.f);
+	__m256 fx = _mm256_floor_ps(x);
+	__m256 fy = _mm256_floor_ps(y);
+	__m256i px = _mm256_cvttps_epi32(fx);
+	__m256i py = _mm256_cvttps_epi32(fy);
+	__m256i x0 = _mm256_and_si256(px, xMask);
+	__m256i x1 = _mm256_and_si256(_mm256_add_epi32(px, one), xMask);
+	__m256i y0 = _mm256_and_si256(py, yMask);
+	__m256i y1 = _mm256_and_si256(_mm256_add_epi32(py, one), yMask);
+	x = _mm256_sub_ps(x, fx);
+	y = _mm256_sub_ps(y, fy);
+	__m256 u = ease(x);
+	__m256 v = ease(y);
+	__m256 xm1 = _mm256_sub_ps(x, onef);
+	__m256 ym1 = _mm256_sub_ps(y, onef);
+
+	__m256i r0 = perm(x0);
+	__m256i r1 = perm(x1);
+	__m256 n00 = grad(perm(_mm256_add_epi32(r0, y0)), x, y);
+	__m256 n01 = grad(perm(_mm256_add_epi32(r0, y1)), x, ym1);
+	__m256 n10 = grad(perm(_mm256_add_epi32(r1, y0)), xm1, y);
+	__m256 n11 = grad(perm(_mm256_add_epi32(r1, y1)), xm1, ym1);
+
+	return lerp(lerp(n00, n01, v), lerp(n10, n11, v), u);
+}
+
+inline __m256 simplexCorner(__m256i hash, __m256 x, __m256 y) {
+	__m256 t = _mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+	t = _mm256_max_ps(t, _mm256_setzero_ps());
+	t = _mm256_mul_ps(t, t);
+	return _mm256_mul_ps(_mm256_mul_ps(t, t), grad(hash, x, y));
+}
+
+inline __m256 simplex2(__m256 x, __m256 y) {
+	const __m256i mask = _mm256_set1_epi32(255);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 onef = _mm256_set1_ps(1.f);
+	const __m256 g2 = _mm256_set1_ps(G2);
+	__m256 s = _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(F2));
+	__m256 fi = _mm256_floor_ps(_mm256_add_ps(x, s));
+	__m256 fj = _mm256_floor_ps(_mm256_add_ps(y, s));
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(fi, fj), g2);
+	__m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(fi, t));
+	__m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(fj, t));
+	// Lower or upper triangle of the skewed cell
+	__m256 lower = _mm256_cmp_ps(x0, y0, _CMP_GT_OQ);
+	__m256 i1 = _mm256_and_ps(lower, onef);
+	__m256 j1 = _mm256_andnot_ps(lower, onef);
+	__m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, i1), g2);
+	__m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, j1), g2);
+	__m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, onef), _mm256_add_ps(g2, g2));
+	__m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, onef), _mm256_add_ps(g2, g2));
+
+	__m256i ii = _mm256_and_si256(_mm256_cvttps_epi32(fi), mask);
+	__m256i jj = _mm256_and_si256(_mm256_cvttps_epi32(fj), mask);
+	__m256i di = _mm256_cvttps_epi32(i1);
+	__m256i dj = _mm256_cvttps_epi32(j1);
+	__m256i h0 = perm(_mm256_add_epi32(perm(ii), jj));
+	__m256i h1 = perm(_mm256_add_epi32(perm(_mm256_add_epi32(ii, di)), _mm256_add_epi32(jj, dj)));
+	__m256i h2 = perm(_mm256_add_epi32(perm(_mm256_add_epi32(ii, one)), _mm256_add_epi32(jj, one)));
+
+	__m256 n = _mm256_add_ps(simplexCorner(h0, x0, y0), simplexCorner(h1, x1, y1));
+	n = _mm256_add_ps(n, simplexCorner(h2, x2, y2));
+	return _mm256_mul_ps(n, _mm256_set1_ps(SIMPLEX_SCALE));
+}
+
+#elif defined(__SSE2__)
+
+#if defined(__SSE4_1__)
+inline __m128i hash(__m128i x) {
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = _mm_mullo_epi32(x, _mm_set1_epi32(0x7feb352d));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = _mm_mullo_epi32(x, _mm_set1_epi32(0x846ca68b));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	return x;
+}
+
+inline __m128 toUnitFloat(__m128i h) {
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(h, 8)), _mm_set1_ps(1.f / 16777216.f));
+}
+#endif
+
+inline __m128 floor(__m128 a) {
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmplt_ps(a, t), _mm_set1_ps(1.f)));
+}
+
+inline __m128 ease(__m128 a) {
+	__m128 t = _mm_sub_ps(_mm_mul_ps(a, _mm_set1_ps(6.f)), _mm_set1_ps(15.f));
+	t = _mm_add_ps(_mm_mul_ps(t, a), _mm_set1_ps(10.f));
+	return _mm_mul_ps(_mm_mul_ps(t, a), _mm_mul_ps(a, a));
+}
+
+inline __m128 lerp(__m128 a, __m128 b, __m128 t) {
+	return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+// No gathers in SSE, so the table lookups are done per lane
+inline __m128i perm(__m128i index) {
+	alignas(16) int i[4];
+	_mm_store_si128((__m128i*)i, index);
+	const int* p = s_tables.perm;
+	return _mm_setr_epi32(p[i[0]], p[i[1]], p[i[2]], p[i[3]]);
+}
+
+inline __m128 grad(__m128i hash, __m128 x, __m128 y) {
+	alignas(16) int i[4];
+	_mm_store_si128((__m128i*)i, hash);
+	const float* gx = s_tables.gradX;
+	const float* gy = s_tables.gradY;
+	__m128 a = _mm_setr_ps(gx[i[0]], gx[i[1]], gx[i[2]], gx[i[3]]);
+	__m128 b = _mm_setr_ps(gy[i[0]], gy[i[1]], gy[i[2]], gy[i[3]]);
+	return _mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y));
+}
+
+inline __m128 perlin2(__m128 x, __m128 y, __m128i xMask, __m128i yMask) {
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128 onef = _mm_set1_ps(1.f);
+	__m128 fx = floor(x);
+	__m128 fy = floor(y);
+	__m128i px = _mm_cvttps_epi32(fx);
+	__m128i py = _mm_cvttps_epi32(fy);
+	__m128i x0 = _mm_and_si128(px, xMask);
+	__m128i x1 = _mm_and_si128(_mm_add_epi32(px, one), xMask);
+	__m128i y0 = _mm_and_si128(py, yMask);
+	__m128i y1 = _mm_and_si128(_mm_add_epi32(py, one), yMask);
+	x = _mm_sub_ps(x, fx);
+	y = _mm_sub_ps(y, fy);
+	__m128 u = ease(x);
+	__m128 v = ease(y);
+	__m128 xm1 = _mm_sub_ps(x, onef);
+	__m128 ym1 = _mm_sub_ps(y, onef);
+
+	__m128i r0 = perm(x0);
+	__m128i r1 = perm(x1);
+	__m128 n00 = grad(perm(_mm_add_epi32(r0, y0)), x, y);
+	__m128 n01 = grad(perm(_mm_add_epi32(r0, y1)), x, ym1);
+	__m128 n10 = grad(perm(_mm_add_epi32(r1, y0)), xm1, y);
+	__m128 n11 = grad(perm(_mm_add_epi32(r1, y1)), xm1, ym1);
+
+	return lerp(lerp(n00, n01, v), lerp(n10, n11, v), u);
+}
+
+inline __m128 simplexCorner(__m128i hash, __m128 x, __m128 y) {
+	__m128 t = _mm_sub_ps(_mm_set1_ps(0.5f), _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+	t = _mm_max_ps(t, _mm_setzero_ps());
+	t = _mm_mul_ps(t, t);
+	return _mm_mul_ps(_mm_mul_ps(t, t), grad(hash, x, y));
+}
+
+inline __m128 simplex2(__m128 x, __m128 y) {
+	const __m128i mask = _mm_set1_epi32(255);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128 onef = _mm_set1_ps(1.f);
+	const __m128 g2 = _mm_set1_ps(G2);
+	__m128 s = _mm_mul_ps(_mm_add_ps(x, y), _mm_set1_ps(F2));
+	__m128 fi = floor(_mm_add_ps(x, s));
+	__m128 fj = floor(_mm_add_ps(y, s));
+	__m128 t = _mm_mul_ps(_mm_add_ps(fi, fj), g2);
+	__m128 x0 = _mm_sub_ps(x, _mm_sub_ps(fi, t));
+	__m128 y0 = _mm_sub_ps(y, _mm_sub_ps(fj, t));
+	// Lower or upper triangle of the skewed cell
+	__m128 lower = _mm_cmpgt_ps(x0, y0);
+	__m128 i1 = _mm_and_ps(lower, onef);
+	__m128 j1 = _mm_andnot_ps(lower, onef);
+	__m128 x1 = _mm_add_ps(_mm_sub_ps(x0, i1), g2);
+	__m128 y1 = _mm_add_ps(_mm_sub_ps(y0, j1), g2);
+	__m128 x2 = _mm_add_ps(_mm_sub_ps(x0, onef), _mm_add_ps(g2, g2));
+	__m128 y2 = _mm_add_ps(_mm_sub_ps(y0, onef), _mm_add_ps(g2, g2));
+
+	__m128i ii = _mm_and_si128(_mm_cvttps_epi32(fi), mask);
+	__m128i jj = _mm_and_si128(_mm_cvttps_epi32(fj), mask);
+	__m128i di = _mm_cvttps_epi32(i1);
+	__m128i dj = _mm_cvttps_epi32(j1);
+	__m128i h0 = perm(_mm_add_epi32(perm(ii), jj));
+	__m128i h1 = perm(_mm_add_epi32(perm(_mm_add_epi32(ii, di)), _mm_add_epi32(jj, dj)));
+	__m128i h2 = perm(_mm_add_epi32(perm(_mm_add_epi32(ii, one)), _mm_add_epi32(jj, one)));
+
+	__m128 n = _mm_add_ps(simplexCorner(h0, x0, y0), simplexCorner(h1, x1, y1));
+	n = _mm_add_ps(n, simplexCorner(h2, x2, y2));
+	return _mm_mul_ps(n, _mm_set1_ps(SIMPLEX_SCALE));
+}
+
+#endif
+
+} // namespace
+
+float perlin2(float x, float y, int xWrap, int yWrap) {
+	const PerlinTables& t = s_tables;
+	unsigned xMask = wrapMask(xWrap);
+	unsigned yMask = wrapMask(yWrap);
+	int px = fastfloor(x);
+	int py = fastfloor(y);
+	int x0 = px & xMask, x1 = (px + 1) & xMask;
+	int y0 = py & yMask, y1 = (py + 1) & yMask;
+	x -= px;
+	y -= py;
+	float u = ease(x);
+	float v = ease(y);
+
+	int r0 = t.perm[x0];
+	int r1 = t.perm[x1];
+	int r00 = t.perm[r0 + y0];
+	int r01 = t.perm[r0 + y1];
+	int r10 = t.perm[r1 + y0];
+	int r11 = t.perm[r1 + y1];
+	float n00 = t.gradX[r00] * x + t.gradY[r00] * y;
+	float n01 = t.gradX[r01] * x + t.gradY[r01] * (y - 1);
+	float n10 = t.gradX[r10] * (x - 1) + t.gradY[r10] * y;
+	float n11 = t.gradX[r11] * (x - 1) + t.gradY[r11] * (y - 1);
+
+	float n0 = n00 + (n01 - n00) * v;
+	float n1 = n10 + (n11 - n10) * v;
+	return n0 + (n1 - n0) * u;
+}
+
+void perlin2(const float* x, const float* y, int count, float* out, int xWrap, int yWrap) {
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i xMask = _mm256_set1_epi32(wrapMask(xWrap));
+	const __m256i yMask = _mm256_set1_epi32(wrapMask(yWrap));
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(out + i, perlin2(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), xMask, yMask));
+#elif defined(__SSE2__)
+	const __m128i xMask = _mm_set1_epi32(wrapMask(xWrap));
+	const __m128i yMask = _mm_set1_epi32(wrapMask(yWrap));
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(out + i, perlin2(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i), xMask, yMask));
+#endif
+	for (; i < count; ++i)
+		out[i] = perlin2(x[i], y[i], xWrap, yWrap);
+}
+
+void perlin3(const float* x, const float* y, const float* z, int count, float* out) {
+	for (int i = 0; i < count; ++i)
+		out[i] = stb_perlin_noise3(x[i], y[i], z[i], 0, 0, 0);
+}
+
+float simplex2(float x, float y) {
+	const int* perm = s_tables.perm;
+	float s = (x + y) * F2;
+	int i = fastfloor(x + s);
+	int j = fastfloor(y + s);
+	float t = (i + j) * G2;
+	float x0 = x - (i - t);
+	float y0 = y - (j - t);
+	// Lower or upper triangle of the skewed cell
+	int i1 = x0 > y0 ? 1 : 0;
+	int j1 = 1 - i1;
+	float x1 = x0 - i1 + G2;
+	float y1 = y0 - j1 + G2;
+	float x2 = x0 - 1.f + 2.f * G2;
+	float y2 = y0 - 1.f + 2.f * G2;
+
+	int ii = i & 255;
+	int jj = j & 255;
+	float n = simplexCorner(perm[perm[ii] + jj], x0, y0);
+	n += simplexCorner(perm[perm[ii + i1] + jj + j1], x1, y1);
+	n += simplexCorner(perm[perm[ii + 1] + jj + 1], x2, y2);
+	return n * SIMPLEX_SCALE;
+}
+
+void simplex2(const float* x, const float* y, int count, float* out) {
+	int i = 0;
+#if defined(__AVX2__)
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(out + i, simplex2(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+#elif defined(__SSE2__)
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(out + i, simplex2(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+#endif
+	for (; i < count; ++i)
+		out[i] = simplex2(x[i], y[i]);
+}
+
+float random(unsigned seed, unsigned stream, int x, int y) {
+	return toUnitFloat(combine(rowKey(seed, stream, y), x));
+}
+
+void random(unsigned seed, unsigned stream, int y, int x0, int count, float* out) {
+	const unsigned key = rowKey(seed, stream, y);
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i step = _mm256_set1_epi32(8);
+	const __m256i keys = _mm256_set1_epi32(key);
+	__m256i x = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(x0));
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(out + i, toUnitFloat(hash(_mm256_xor_si256(keys, hash(x)))));
+		x = _mm256_add_epi32(x, step);
+	}
+#elif defined(__SSE4_1__)
+	const __m128i step = _mm_set1_epi32(4);
+	const __m128i keys = _mm_set1_epi32(key);
+	__m128i x = _mm_add_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(x0));
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(out + i, toUnitFloat(hash(_mm_xor_si128(keys, hash(x)))));
+		x = _mm_add_epi32(x, step);
+	}
+#endif
+	for (; i < count; ++i)
+		out[i] = toUnitFloat(combine(key, x0 + i));
+}
+
+} // namespace
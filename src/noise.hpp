@@ -0,0 +1,34 @@
+#pragma once
+
+namespace gentex {
+
+	// 2D gradient noise in the range [-1, 1]. Uses the same lattice, hashing
+	// and gradients as stb_perlin_noise3(x, y, 0, xWrap, yWrap, 0), but skips
+	// the z axis altogether. Results match it up to float rounding.
+	// Wrap values must be powers of two, 0 means no wrapping (i.e. 256).
+	float perlin2(float x, float y, int xWrap = 0, int yWrap = 0);
+
+	// Evaluates count samples at (x[i], y[i]) into out, 8 (AVX2) or
+	// 4 (SSE2) at a time
+	void perlin2(const float* x, const float* y, int count, float* out, int xWrap = 0, int yWrap = 0);
+
+	// 3D gradient noise, stb_perlin_noise3() without wrapping for each of
+	// count samples (scalar, there is no SIMD version)
+	void perlin3(const float* x, const float* y, const float* z, int count, float* out);
+
+	// 2D simplex noise in the range [-1, 1], sums 3 corners of a triangle
+	// instead of the 4 of a square, using the same hashing and gradients
+	float simplex2(float x, float y);
+
+	// Evaluates count samples at (x[i], y[i]) into out, SIMD like perlin2()
+	void simplex2(const float* x, const float* y, int count, float* out);
+
+	// Counter based white noise in [0, 1). Each value is a hash of the seed,
+	// stream and pixel coordinates rather than the next value of a sequence,
+	// so pixels can be generated in any order or on any thread.
+	float random(unsigned seed, unsigned stream, int x, int y);
+
+	// Fills out with the values for pixels x0 ... x0 + count - 1 of row y
+	void random(unsigned seed, unsigned stream, int y, int x0, int count, float* out);
+
+} // namespace
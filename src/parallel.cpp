@@ -0,0 +1,126 @@
+#include "parallel.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+#include "math.hpp"
+
+namespace gentex {
+
+namespace {
+
+thread_local bool t_inPool = false;
+thread_local int t_index = 0;
+
+class ThreadPool {
+public:
+	~ThreadPool() { resize(0); }
+
+	// Total thread count, including the caller of run()
+	int size() const { return workers.size() + 1; }
+
+	void resize(int extraWorkers) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+		quit = false;
+		uint current = generation;
+		for (int i = 0; i < extraWorkers; ++i)
+			workers.emplace_back([this, current, i] { t_index = i + 1; loop(current); });
+	}
+
+	void run(int count, const RangeFunction& func, int grain) {
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &func;
+		jobSize = count;
+		// A few chunks per thread keeps the load balanced when rows differ in cost
+		chunk = max(grain, count / (size() * 4));
+		next = 0;
+		pending = workers.size();
+		++generation;
+		lock.unlock();
+		wake.notify_all();
+		work();
+		lock.lock();
+		done.wait(lock, [this] { return pending == 0; });
+		job = nullptr;
+	}
+
+private:
+	void work() {
+		t_inPool = true;
+		int begin;
+		while ((begin = next.fetch_add(chunk)) < jobSize)
+			(*job)(begin, min(begin + chunk, jobSize));
+		t_inPool = false;
+	}
+
+	void loop(uint seen) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+			lock.unlock();
+			work();
+			lock.lock();
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const RangeFunction* job = nullptr;
+	int jobSize = 0;
+	int chunk = 1;
+	std::atomic<int> next { 0 };
+	int pending = 0;
+	uint generation = 0;
+	bool quit = false;
+};
+
+ThreadPool& pool() {
+	static ThreadPool s_pool;
+	return s_pool;
+}
+
+} // namespace
+
+void SetThreadCount(int count) {
+	if (count <= 0)
+		count = max(1u, std::thread::hardware_concurrency());
+	if (count != pool().size())
+		pool().resize(count - 1);
+}
+
+int GetThreadCount() {
+	return pool().size();
+}
+
+int GetThreadIndex() {
+	return t_index;
+}
+
+void ParallelFor(int count, const RangeFunction& func, int grain) {
+	if (count <= 0)
+		return;
+	if (t_inPool || pool().size() == 1 || count <= grain) {
+		func(0, count);
+		return;
+	}
+	pool().run(count, func, grain);
+}
+
+} // namespace
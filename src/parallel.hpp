@@ -0,0 +1,22 @@
+#pragma once
+#include <functional>
+
+namespace gentex {
+
+	// Processes the half-open range [begin, end)
+	typedef std::function<void(int, int)> RangeFunction;
+
+	// 0 means one thread per hardware core
+	void SetThreadCount(int count);
+	int GetThreadCount();
+
+	// Index of the calling thread below GetThreadCount(), 0 for the thread
+	// calling ParallelFor(), for per thread state
+	int GetThreadIndex();
+
+	// Splits [0, count) into chunks of at least grain items and runs them
+	// on the worker pool. The calling thread helps out and the call blocks
+	// until every chunk is done. Nested calls run serially.
+	void ParallelFor(int count, const RangeFunction& func, int grain = 1);
+
+} // namespace
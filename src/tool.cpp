@@ -4,6 +4,7 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
+#include <cstdlib>
 
 #include "gentex.hpp"
 
@@ -11,6 +12,9 @@ using namespace gentex;
 using std::chrono::steady_clock;
 using std::chrono::duration_cast;
 
+static ImageLayout s_layout = LAYOUT_INTERLEAVED;
+static const long MAX_JOBS = 1024;
+
 std::string readFile(const std::string& path) {
 	std::ifstream f(path);
 	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
@@ -27,12 +31,10 @@ bool doTexture(const Json& spec) {
 	auto t0 = steady_clock::now();
 	int w = spec["size"][0].int_value();
 	int h = spec["size"][1].int_value();
-	Generator gen(w, h);
+	Generator gen(w, h, s_layout);
 
-	const auto& cmds = spec["ops"].array_items();
-	for (const auto& cmd : cmds) {
-		gen.processCommand(cmd);
-	}
+	Plan plan = CompilePlan(spec["ops"]);
+	gen.run(plan);
 
 	auto t1 = steady_clock::now();
 	auto dtms = duration_cast<std::chrono::milliseconds>(t1 - t0).count();
@@ -65,21 +67,35 @@ bool doScript(const std::string& text) {
 int main(int argc, char** argv) {
 	std::vector<std::string> paths;
 	bool watch = false;
+	int jobs = 0;
 	for (int i = 1; i < argc; ++i) {
 		std::string arg = argv[i];
 		if (arg == "-h" || arg == "--help") {
-			std::cout << "USAGE: " << argv[0] << " [-w | --watch] FILE1 [FILE2...]" << std::endl;
+			std::cout << "USAGE: " << argv[0] << " [-w | --watch] [-j N | --jobs N] [--planar] FILE1 [FILE2...]" << std::endl;
 			return 0;
 		}
 		else if (arg == "-w" || arg == "--watch") {
 			watch = true;
 		}
+		else if (arg == "-j" || arg == "--jobs") {
+			if (++i >= argc)
+				panic("Specify the number of jobs");
+			char* end = nullptr;
+			long value = std::strtol(argv[i], &end, 10);
+			if (end == argv[i] || *end || value < 1 || value > MAX_JOBS)
+				panic("The number of jobs must be an integer from 1 to 1024");
+			jobs = value;
+		}
+		else if (arg == "--planar") {
+			s_layout = LAYOUT_PLANAR;
+		}
 		else paths.push_back(arg);
 	}
 	if (paths.empty())
 		panic("Specify input file");
 
 	InitMathParser();
+	SetThreadCount(jobs);
 
 	int failCount = 0;
 	std::vector<std::string> texts;
@@ -0,0 +1,20 @@
+# Renders SPEC with one thread and with several, the images must be equal.
+# Usage: cmake -DGENTEX=... -DSPEC=... -DOUT=... -P jobs.cmake
+foreach(JOBS 1 4)
+	file(REMOVE_RECURSE ${OUT}/j${JOBS})
+	file(MAKE_DIRECTORY ${OUT}/j${JOBS})
+	execute_process(COMMAND ${GENTEX} -j ${JOBS} ${SPEC} WORKING_DIRECTORY ${OUT}/j${JOBS} RESULT_VARIABLE RESULT OUTPUT_QUIET)
+	if(NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "gentex -j ${JOBS} ${SPEC} failed")
+	endif()
+endforeach()
+file(GLOB IMAGES RELATIVE ${OUT}/j1 ${OUT}/j1/*)
+if(NOT IMAGES)
+	message(FATAL_ERROR "${SPEC} produced no images")
+endif()
+foreach(IMAGE ${IMAGES})
+	execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUT}/j1/${IMAGE} ${OUT}/j4/${IMAGE} RESULT_VARIABLE RESULT)
+	if(NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "${IMAGE} differs between -j 1 and -j 4")
+	endif()
+endforeach()
@@ -10,13 +10,53 @@
 #include <iostream>
 #include <chrono>
 #include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
 
 #include "shunting-yard-cpp/shunting-yard.hpp"
+#include "noise.hpp"
 using namespace calc;
 
 static int tests = 0;
 static int fails = 0;
 
+// Compares batch evaluation (native code where supported) of count values
+// of x against the scalar interpreter, returns the largest relative difference
+static double batchDifference(MathExpression& expr, const double* xs, int count) {
+	double out[16];
+	expr.compileNative('x');
+	expr.eval('x', xs, count, out);
+	double diff = 0;
+	for (int i = 0; i < count; ++i) {
+		expr.setVar('x', xs[i]);
+		double ref = expr.eval();
+		diff = std::max(diff, std::fabs(out[i] - ref) / std::max(1.0, std::fabs(ref)));
+	}
+	return diff;
+}
+
+// Same in float, without and with native code, returns the largest
+// relative difference
+static double floatDifference(const std::string& expression, const double* xs, int count) {
+	float in[16], out[16];
+	std::copy(xs, xs + count, in);
+	double diff = 0;
+	for (int native = 0; native < 2; ++native) {
+		MathExpression expr(expression);
+		if (native)
+			expr.compileNative('x', PRECISION_FLOAT);
+		expr.eval('x', in, count, out);
+		for (int i = 0; i < count; ++i) {
+			expr.setVar('x', in[i]);
+			double ref = expr.eval();
+			diff = std::max(diff, std::fabs(out[i] - ref) / std::max(1.0, std::fabs(ref)));
+		}
+	}
+	return diff;
+}
+
 #define ASSERT_RESULT(expression, result) do { \
 	tests++; \
 	Status status; \
@@ -28,6 +68,165 @@ static int fails = 0;
 	} else if (std::fabs(res - result) > 1e-6) { \
 		std::cout << "Expression " << #expression << " failed: got " << res << ", expected " << result << std::endl; \
 		fails++; \
+	} else { \
+		const double xs[7] = {}; \
+		if (batchDifference(expr, xs, 7) > 1e-9) { \
+			std::cout << "Expression " << #expression << " failed in batch evaluation" << std::endl; \
+			fails++; \
+		} \
+	} \
+} while(0);
+
+#define ASSERT_STATUS(expression, expected) do { \
+	tests++; \
+	Status status; \
+	MathExpression::eval(expression, &status); \
+	if (status != expected) { \
+		std::cout << "Expression " << #expression << " gave code " << status << ", expected " << expected << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Checks batch evaluation over a span of x values against the interpreter
+#define ASSERT_BATCH(expression) do { \
+	tests++; \
+	const double xs[11] = { -4, -2.5, -1, 0, 0.5, 1, 2, 3, 5.5, 10, 100 }; \
+	MathExpression expr(expression); \
+	if (batchDifference(expr, xs, 11) > 1e-9) { \
+		std::cout << "Expression " << #expression << " failed in batch evaluation" << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Checks float batch evaluation against the double interpreter
+#define ASSERT_FLOAT(expression) do { \
+	tests++; \
+	const double xs[11] = { -4, -2.5, -1, 0, 0.5, 1, 2, 3, 5.5, 10, 100 }; \
+	if (floatDifference(expression, xs, 11) > 1e-4) { \
+		std::cout << "Expression " << #expression << " failed in float evaluation" << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Checks an expression split into image, row and pixel parts against
+// the plain one for a few images, rows and pixels
+#define ASSERT_HOISTED(expression) do { \
+	tests++; \
+	MathExpression plain(expression), hoisted(expression); \
+	hoisted.hoist("wh", "y"); \
+	double diff = 0; \
+	for (int w = 1; w <= 64; w *= 4) { \
+		plain.setVar('w', w); plain.setVar('h', w / 2); \
+		hoisted.setVar('w', w); hoisted.setVar('h', w / 2); \
+		for (int y = -2; y < 3; ++y) { \
+			for (int x = -2; x < 3; ++x) { \
+				plain.bind(x, y); \
+				hoisted.bind(x, y); \
+				diff = std::max(diff, std::fabs(plain.eval() - hoisted.eval())); \
+			} \
+		} \
+	} \
+	if (diff > 1e-9) { \
+		std::cout << "Expression " << #expression << " failed when hoisted" << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Checks three expressions compiled into one shared program, hoisted and
+// evaluated in batch, against each compiled on its own
+#define ASSERT_SHARED(a, b, c) do { \
+	tests++; \
+	const std::string exprs[3] = { a, b, c }; \
+	const double xs[11] = { -4, -2.5, -1, 0, 0.5, 1, 2, 3, 5.5, 10, 100 }; \
+	MathExpression shared(std::vector<std::string>(exprs, exprs + 3)); \
+	shared.hoist("wh", "y"); \
+	shared.setVar('w', 64); shared.setVar('h', 32); \
+	shared.compileNative('x'); \
+	double diff = 0; \
+	for (int y = -2; y < 3; ++y) { \
+		double out[33]; \
+		shared.setVar('y', y); \
+		shared.eval('x', xs, 11, out); \
+		for (int i = 0; i < 3; ++i) { \
+			MathExpression single(exprs[i]); \
+			single.setVar('w', 64); single.setVar('h', 32); \
+			for (int j = 0; j < 11; ++j) { \
+				single.bind(xs[j], y); \
+				double ref = single.eval(); \
+				diff = std::max(diff, std::fabs(out[i * 11 + j] - ref) / std::max(1.0, std::fabs(ref))); \
+			} \
+		} \
+	} \
+	if (diff > 1e-9) { \
+		std::cout << "Expressions " << #a << ", " << #b << ", " << #c << " failed when shared" << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Checks that contexts of one expression keep their own variables and
+// hoisted results, evaluating in turns against a plain expression
+#define ASSERT_CONTEXTS(expression) do { \
+	tests++; \
+	const double xs[11] = { -4, -2.5, -1, 0, 0.5, 1, 2, 3, 5.5, 10, 100 }; \
+	MathExpression shared(expression), plain(expression); \
+	shared.hoist("wh", "y"); \
+	shared.setVar('w', 64); shared.setVar('h', 32); \
+	plain.setVar('w', 64); plain.setVar('h', 32); \
+	shared.compileNative('x'); \
+	MathContext a(shared), b(shared); \
+	double diff = 0; \
+	for (int y = -2; y < 3; ++y) { \
+		double outA[11], outB[11]; \
+		a.setVar('y', y); \
+		b.setVar('y', -y); \
+		a.eval('x', xs, 11, outA); \
+		b.eval('x', xs, 11, outB); \
+		for (int j = 0; j < 11; ++j) { \
+			plain.bind(xs[j], y); \
+			diff = std::max(diff, std::fabs(outA[j] - plain.eval())); \
+			plain.bind(xs[j], -y); \
+			diff = std::max(diff, std::fabs(outB[j] - plain.eval())); \
+		} \
+	} \
+	if (diff > 1e-9) { \
+		std::cout << "Expression " << #expression << " failed in separate contexts" << std::endl; \
+		fails++; \
+	} \
+} while(0);
+
+// Returns how many rows of white noise are a shifted copy of another one,
+// looking for the first values of each row anywhere within the others.
+// row(y, out) fills out with the width values of row y.
+template<typename F>
+static int shiftedRows(int width, int height, F row) {
+	std::vector<float> a(width), b(width);
+	auto key = [](const float* v) { return uint64_t(v[0] * 16777216.f) << 24 | uint64_t(v[1] * 16777216.f); };
+	std::unordered_map<uint64_t, int> starts;
+	for (int y = 0; y < height; ++y) {
+		row(y, &a[0]);
+		starts[key(&a[0])] = y;
+	}
+	int shifted = 0;
+	for (int y = 0; y < height; ++y) {
+		row(y, &b[0]);
+		for (int x = 0; x + 1 < width; ++x) {
+			auto it = starts.find(key(&b[x]));
+			if (it == starts.end() || (it->second == y && x == 0))
+				continue;
+			row(it->second, &a[0]);
+			if (std::equal(b.begin() + x, b.end(), a.begin()))
+				shifted++;
+		}
+	}
+	return shifted;
+}
+
+#define ASSERT_UNSHIFTED(name, width, height, row) do { \
+	tests++; \
+	int shifted = shiftedRows(width, height, row); \
+	if (shifted) { \
+		std::cout << name << " failed: " << shifted << " rows are shifted copies of others" << std::endl; \
+		fails++; \
 	} \
 } while(0);
 
@@ -119,6 +318,37 @@ int main(int, char*[]) {
 	ASSERT_RESULT("ln(e)", 1);
 	ASSERT_RESULT("log(10^42)", 42);
 	ASSERT_RESULT("lb(2^123)", 123);
+	ASSERT_RESULT("exp(0)", 1);
+	ASSERT_RESULT("sin(2*(0.5+0.5))", sin(2));
+
+	// Functions of several arguments
+	ASSERT_RESULT("min(3, -2)", -2);
+	ASSERT_RESULT("max(3, -2) + 1", 4);
+	ASSERT_RESULT("min(max(1, 2), 3 * (1 + 1))", 2);
+	ASSERT_RESULT("atan2(1, -1)", 3 * M_PI / 4);
+	ASSERT_RESULT("step(0.5, 0.25) + step(0.5, 0.75)*2", 2);
+	ASSERT_RESULT("mix(2, 4, 0.25)", 2.5);
+	ASSERT_RESULT("clamp(-5, 0, 1) + clamp(0.5, 0, 1) + clamp(5, 0, 1)", 1.5);
+	ASSERT_RESULT("smoothstep(0, 2, 1) + smoothstep(0, 2, -1)", 0.5);
+	ASSERT_RESULT("-max(-1, -2)", 1);
+	ASSERT_STATUS("min(1)", ERROR_FUNCTION_ARGUMENTS);
+	ASSERT_STATUS("sin(1, 2)", ERROR_FUNCTION_ARGUMENTS);
+	ASSERT_STATUS("max(1, )", ERROR_FUNCTION_ARGUMENTS);
+	ASSERT_STATUS("(1, 2)", ERROR_SYNTAX);
+	ASSERT_STATUS("1, 2", ERROR_SYNTAX);
+
+	// Long expressions, nesting deeper than recursion would allow
+	std::string sum = "0", sumX = "1", nested;
+	for (int i = 0; i < 100000; ++i) {
+		sum += " + 1";
+		sumX += " + x";
+	}
+	for (int i = 0; i < 20000; ++i)
+		nested += "1 + (";
+	nested += "1" + std::string(20000, ')');
+	ASSERT_RESULT(sum, 100000);
+	ASSERT_RESULT(sumX, 1);
+	ASSERT_RESULT(nested, 20001);
 
 	// Test constant
 	ASSERT_RESULT("sin(pi)", 0);
@@ -146,6 +376,75 @@ int main(int, char*[]) {
 	ASSERT_RESULT("10^-2pi", M_PI / 100);
 	ASSERT_RESULT("2^2^3", 256);
 
+	// Batch evaluation
+	ASSERT_BATCH("x");
+	ASSERT_BATCH("-x + 2x - x/3");
+	ASSERT_BATCH("abs(cos(pi + x/10)) * 0.5 + 0.5 - 0.75");
+	ASSERT_BATCH("x^2 - 3x + 1");
+	ASSERT_BATCH("x^3 + (x/2)^2.5 - 2^x");
+	ASSERT_BATCH("(x > 1) * sqrt(abs(x)) + (x < 0) * exp(x)");
+	ASSERT_BATCH("x % 3 + abs(x)! / 10");
+	ASSERT_BATCH("2^(x/4) * (1 + (2 + (3 + (4 + (5 + (6 + x))))))");
+	ASSERT_BATCH("(x+1)(x+2)(x+3)(x+4)(x+5)(x+6)(x+7)(x+8)(x+9)(x+10)(x+11)(x+12)(x+13)(x+14)(x+15)(x+16)(x+17)");
+	ASSERT_BATCH("min(x, 2) + max(-x, 1) * atan2(x, 3)");
+	ASSERT_BATCH("mix(x, x^2, 0.3) + clamp(x, -1, 2) + smoothstep(-1, 3, x) + step(1, x)");
+	ASSERT_BATCH("1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+(13+(14+(15+(16+x)))))))))))))))");
+
+	// Float batch evaluation
+	ASSERT_FLOAT("-x + 2x - x/3");
+	ASSERT_FLOAT("abs(cos(pi + x/10)) * 0.5 + 0.5 - 0.75");
+	ASSERT_FLOAT("(x > 1) * sqrt(abs(x)) + (x < 0) * exp(x)");
+	ASSERT_FLOAT("x^2 - 3x + 1 + x % 3 + abs(x/10)!");
+	ASSERT_FLOAT("sin(x/7) * 0.5 + 0.5 + lb(abs(x) + 1)");
+	ASSERT_FLOAT("mix(x, x^2, 0.3) + clamp(x, -1, 2) + smoothstep(-1, 3, x) + min(x, rnd(0))");
+
+	// Constant folding and hoisting
+	ASSERT_RESULT("2 * (3 + 4) - sqrt(16)", 10);
+	ASSERT_HOISTED("abs(cos(pi + x/10)) * 0.5 + 0.5 - 0.75");
+	ASSERT_HOISTED("sin(y / h * tau) * x + w / 2");
+	ASSERT_HOISTED("(x - w/2)^2 + (y - h/2)^2 < (w/4)^2");
+	ASSERT_HOISTED("y * 2 + h");
+	ASSERT_HOISTED("-(w + h)! / (1 + y^2)");
+
+	// Subexpressions shared across expressions
+	ASSERT_SHARED("sin(x/w) * 0.5 + 0.5", "sin(x/w) * 0.25", "cos(x/w) + sin(x/w)");
+	ASSERT_SHARED("(x - w/2)^2 + (y - h/2)^2", "sqrt((x - w/2)^2 + (y - h/2)^2) / w", "y/h");
+	ASSERT_SHARED("abs(x) * abs(x) + 1", "x", "2");
+	ASSERT_SHARED("x % 3 + (x % 3)!", "exp(-x % 3)", "x % 3 * y");
+
+	// Evaluation contexts and stateless functions
+	ASSERT_CONTEXTS("sin(y / h * tau) * x + w / 2");
+	ASSERT_CONTEXTS("(x - w/2)^2 + (y - h/2)^2 + rnd(x, y)");
+	ASSERT_FLOAT("rnd(x, 3) + rnd(x / 4, x, 5)");
+	ASSERT_RESULT("rnd(3, 4) - rnd(3.5, 4.75)", 0);
+	ASSERT_RESULT("rnd(3, 4, 7) - rnd(3.25, 4, 7)", 0);
+	ASSERT_RESULT("(rnd(3, 4) > -0.5) * (rnd(3, 4) < 1)", 1);
+	ASSERT_RESULT("abs(rnd(3, 4) - rnd(4, 3)) > 0", 1);
+	ASSERT_RESULT("abs(rnd(3, 4, 1) - rnd(3, 4, 2)) > 0", 1);
+	ASSERT_RESULT("rnd(2) - 2 rnd(0, 0, -1)", 0);
+	ASSERT_RESULT("abs(rnd(1) - rnd(1)) > 0", 1);
+	ASSERT_CONTEXTS("rnd(1) + y * rnd(x)");
+	ASSERT_FLOAT("rnd(x) + rnd(2)");
+	{
+		std::vector<double> xs(4096), out(4096);
+		for (int i = 0; i < 4096; ++i)
+			xs[i] = i;
+		MathExpression expr("rnd(x, y)");
+		ASSERT_UNSHIFTED("Expression \"rnd(x, y)\"", 4096, 4096, [&](int y, float* row) {
+			expr.setVar('y', y);
+			expr.eval('x', &xs[0], 4096, &out[0]);
+			std::copy(out.begin(), out.end(), row);
+		});
+	}
+	// The noise command, alternating rows of two streams
+	ASSERT_UNSHIFTED("Noise", 4096, 4096, [](int y, float* row) { gentex::random(0, y & 1, y >> 1, 0, 4096, row); });
+	// One-off evaluations, such as of parameters, have no pixel to hash
+	tests++;
+	if (MathExpression::eval("rnd(1)") == MathExpression::eval("rnd(1)")) {
+		std::cout << "Expression \"rnd(1)\" failed: two evaluations gave the same value" << std::endl;
+		fails++;
+	}
+
 	auto t1 = std::chrono::steady_clock::now();
 	auto dtus = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
 
@@ -0,0 +1,379 @@
+// Copyright 2015 Tapio Vierros.
+//
+// Use of this source code is governed by the BSD 2-Clause License that can be
+// found in the LICENSE file.
+
+// Compiles MathExpression programs to x86-64 AVX code that evaluates four
+// doubles or eight floats at a time. The expression stack lives in ymm registers, anything
+// that is not a plain arithmetic instruction calls back into C++ with the
+// live registers spilled to the machine stack.
+
+#include "shunting-yard.hpp"
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__) && (defined(__linux__) || defined(__APPLE__))
+#define CALC_JIT 1
+#include <sys/mman.h>
+#endif
+
+namespace calc {
+
+static const int LANES = 4;
+static const int FLOAT_LANES = 8;
+
+#ifdef CALC_JIT
+
+namespace {
+
+const int YMM_COUNT = 16;
+const int SPILL_BYTES = YMM_COUNT * 32;
+
+// General purpose registers
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+// Register roles inside the generated function
+const int REG_VALUES = RBX, REG_CONSTS = R14, REG_OUT = R13, REG_COUNT = R12, REG_INDEX = R15;
+
+// Helpers called from the generated code, on LANES values at a time
+void helperPow(double* a, const double* b) { for (int i = 0; i < LANES; ++i) a[i] = pow(a[i], b[i]); }
+void helperMod(double* a, const double* b) { for (int i = 0; i < LANES; ++i) a[i] = fmod(a[i], b[i]); }
+void helperFactorial(double* a) { for (int i = 0; i < LANES; ++i) a[i] = tgamma(a[i] + 1); }
+// Calls of functions without a batch version, arguments are spilled
+// next to each other
+template<typename T, int N>
+void helperScalar(T* a, const Function* function) {
+	double args[Function::MAX_ARGS];
+	for (int i = 0; i < N; ++i) {
+		for (int j = 0; j < function->args; ++j)
+			args[j] = a[j * N + i];
+		a[i] = function->func(args);
+	}
+}
+void helperPowFloat(float* a, const float* b) { for (int i = 0; i < FLOAT_LANES; ++i) a[i] = pow(a[i], b[i]); }
+void helperModFloat(float* a, const float* b) { for (int i = 0; i < FLOAT_LANES; ++i) a[i] = fmod(a[i], b[i]); }
+void helperFactorialFloat(float* a) { for (int i = 0; i < FLOAT_LANES; ++i) a[i] = tgamma(a[i] + 1); }
+void helperBatchFloat(float* a, const Function* function) {
+	double values[Function::MAX_ARGS * FLOAT_LANES];
+	std::copy(a, a + function->args * FLOAT_LANES, values);
+	function->batch(values, FLOAT_LANES, FLOAT_LANES, values);
+	std::copy(values, values + FLOAT_LANES, a);
+}
+
+// Memory operand [base + index * element size + disp], index < 0 for none
+struct Mem {
+	int base;
+	int index;
+	int disp;
+};
+
+class Assembler {
+public:
+	std::vector<unsigned char> code;
+	bool single = false; // Packed floats instead of doubles
+
+	void byte(int b) { code.push_back(b); }
+	void dword(uint32_t v) { for (int i = 0; i < 4; ++i) byte(v >> (i * 8)); }
+	void qword(uint64_t v) { for (int i = 0; i < 8; ++i) byte(v >> (i * 8)); }
+
+	void modrm(int reg, int rm) { byte(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+
+	void modrm(int reg, const Mem& m) {
+		// Always mod 10 with a 32-bit displacement, which works for every base
+		if (m.index >= 0 || (m.base & 7) == RSP) {
+			byte(0x80 | (reg & 7) << 3 | 4);
+			byte((m.index >= 0 ? (single ? 2 : 3) << 6 | (m.index & 7) << 3 : 4 << 3) | (m.base & 7));
+		} else byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+		dword(m.disp);
+	}
+
+	// 3-byte VEX prefix, map 1 = 0F, 2 = 0F38, 3 = 0F3A, always 256-bit.
+	// The map 1 instructions are the pd ones with 66, ps ones without.
+	void vex(int map, int reg, int vvvv, int x, int b) {
+		byte(0xC4);
+		byte((~reg >> 3 & 1) << 7 | (~x >> 3 & 1) << 6 | (~b >> 3 & 1) << 5 | map);
+		byte((~vvvv & 15) << 3 | 1 << 2 | (map == 1 && single ? 0 : 1));
+	}
+
+	// ymm op ymm, ymm
+	void avx(int map, int opcode, int dst, int src1, int src2) {
+		vex(map, dst, src1, 0, src2);
+		byte(opcode);
+		modrm(dst, src2);
+	}
+
+	// ymm op mem
+	void avx(int map, int opcode, int reg, const Mem& m) {
+		vex(map, reg, 0, m.index >= 0 ? m.index : 0, m.base);
+		byte(opcode);
+		modrm(reg, m);
+	}
+
+	void vmovupdLoad(int dst, const Mem& m) { avx(1, 0x10, dst, m); }
+	void vmovupdStore(const Mem& m, int src) { avx(1, 0x11, src, m); }
+	void vbroadcast(int dst, const Mem& m) { avx(2, single ? 0x18 : 0x19, dst, m); }
+	void vcmppd(int dst, int a, int b, int predicate) { avx(1, 0xC2, dst, a, b); byte(predicate); }
+	void vroundpd(int dst, int src, int mode) { avx(3, 0x09, dst, 0, src); byte(mode); }
+	void vzeroupper() { byte(0xC5); byte(0xF8); byte(0x77); }
+
+	void rex(int reg, int rm) { byte(0x48 | (reg >> 3) << 2 | (rm >> 3)); }
+	void push(int r) { if (r >= 8) byte(0x41); byte(0x50 + (r & 7)); }
+	void pop(int r) { if (r >= 8) byte(0x41); byte(0x58 + (r & 7)); }
+	void mov(int dst, int src) { rex(src, dst); byte(0x89); modrm(src, dst); }
+	void movImm(int dst, uint64_t v) { rex(0, dst); byte(0xB8 + (dst & 7)); qword(v); }
+	void lea(int dst, const Mem& m) { rex(dst, m.base); byte(0x8D); modrm(dst, m); }
+	void movLoad(int dst, const Mem& m) { rex(dst, m.base); byte(0x8B); modrm(dst, m); }
+	void xorSelf(int r) { rex(r, r); byte(0x31); modrm(r, r); }
+	void addImm(int r, int v) { rex(0, r); byte(0x81); modrm(0, r); dword(v); }
+	void subImm(int r, int v) { rex(0, r); byte(0x81); modrm(5, r); dword(v); }
+	void cmp(int a, int b) { rex(b, a); byte(0x39); modrm(b, a); }
+	void callRax() { byte(0xFF); byte(0xD0); }
+	void ret() { byte(0xC3); }
+	// Jump if below (unsigned) back to an earlier position
+	void jbBack(size_t target) {
+		byte(0x0F); byte(0x82);
+		dword(uint32_t(int(target) - int(code.size() + 4)));
+	}
+};
+
+const int OP_VANDPD = 0x54, OP_VXORPD = 0x57, OP_VADDPD = 0x58, OP_VMULPD = 0x59, OP_VSUBPD = 0x5C, OP_VDIVPD = 0x5E;
+const int CMP_LT_OQ = 0x11, CMP_GT_OQ = 0x1E;
+
+Mem spillSlot(int i) { return Mem { RSP, -1, i * 32 }; }
+// Temporaries of OPCODE_KEEP follow the spill area
+Mem tempSlot(int i) { return Mem { RSP, -1, SPILL_BYTES + i * 32 }; }
+Mem constant(const Assembler& a, int i) { return Mem { REG_CONSTS, -1, i * (a.single ? 4 : 8) }; }
+
+void spill(Assembler& a, int depth) {
+	for (int i = 0; i < depth; ++i)
+		a.vmovupdStore(spillSlot(i), i);
+	a.vzeroupper();
+}
+
+void reload(Assembler& a, int depth) {
+	for (int i = 0; i < depth; ++i)
+		a.vmovupdLoad(i, spillSlot(i));
+}
+
+void call(Assembler& a, const void* func) {
+	a.movImm(RAX, reinterpret_cast<uint64_t>(func));
+	a.callRax();
+}
+
+} // namespace
+
+struct NativeCode {
+	void* memory;
+	size_t size;
+	NativeFunc func;
+	NativeFloatFunc floatFunc;
+	int outputs;
+
+	NativeCode(): memory(NULL), size(0), func(NULL), floatFunc(NULL), outputs(0) {}
+	~NativeCode() { if (memory) munmap(memory, size); }
+};
+
+std::shared_ptr<NativeCode> compileNative(const std::vector<Instruction>& program, int slot, int slotCount, int maxStackSize, Precision precision)
+{
+	// One spare register is needed for temporaries
+	if (maxStackSize + 1 > YMM_COUNT || !__builtin_cpu_supports("avx"))
+		return NULL;
+
+	int temps = 0;
+	for (const Instruction& instr : program) {
+		if (instr.opcode == OPCODE_KEEP)
+			temps = std::max(temps, instr.slot + 1);
+	}
+	const int frame = SPILL_BYTES + temps * 32;
+
+	Assembler a;
+	a.single = precision == PRECISION_FLOAT;
+	const int lanes = a.single ? FLOAT_LANES : LANES;
+	const int saved[] = { RBX, R12, R13, R14, R15 };
+	for (int r : saved)
+		a.push(r);
+	a.subImm(RSP, frame);
+	a.mov(REG_VALUES, RDI);
+	a.mov(REG_CONSTS, RSI);
+	a.mov(REG_OUT, RDX);
+	a.mov(REG_COUNT, RCX);
+	a.xorSelf(REG_INDEX);
+
+	size_t loop = a.code.size();
+	int depth = 0;
+	for (size_t i = 0; i < program.size(); ++i) {
+		const Instruction& instr = program[i];
+		int top = depth - 1, next = depth - 2;
+		switch (instr.opcode) {
+			case OPCODE_PUSH:
+				a.vbroadcast(depth++, constant(a, NATIVE_CONSTS + slotCount + i));
+				break;
+			case OPCODE_LOAD:
+				if (instr.slot == slot)
+					a.vmovupdLoad(depth++, Mem { REG_VALUES, REG_INDEX, 0 });
+				else a.vbroadcast(depth++, constant(a, NATIVE_CONSTS + instr.slot));
+				break;
+			case OPCODE_STORE:
+				return NULL; // Only in the stages
+			case OPCODE_KEEP:
+				a.vmovupdStore(tempSlot(instr.slot), top);
+				break;
+			case OPCODE_REUSE:
+				a.vmovupdLoad(depth++, tempSlot(instr.slot));
+				break;
+			case OPCODE_NEG:
+				a.vbroadcast(depth, constant(a, NATIVE_SIGN));
+				a.avx(1, OP_VXORPD, top, top, depth);
+				break;
+			case OPCODE_ADD: a.avx(1, OP_VADDPD, next, next, top); --depth; break;
+			case OPCODE_SUB: a.avx(1, OP_VSUBPD, next, next, top); --depth; break;
+			case OPCODE_MUL: a.avx(1, OP_VMULPD, next, next, top); --depth; break;
+			case OPCODE_DIV: a.avx(1, OP_VDIVPD, next, next, top); --depth; break;
+			case OPCODE_LESS:
+			case OPCODE_GREATER:
+				a.vcmppd(next, next, top, instr.opcode == OPCODE_LESS ? CMP_LT_OQ : CMP_GT_OQ);
+				a.vbroadcast(top, constant(a, NATIVE_ONE));
+				a.avx(1, OP_VANDPD, next, next, top);
+				--depth;
+				break;
+			case OPCODE_POW:
+				// Squares and cubes are common enough to skip the call
+				if (i > 0 && program[i - 1].opcode == OPCODE_PUSH &&
+						(program[i - 1].num == 2.0 || program[i - 1].num == 3.0)) {
+					if (program[i - 1].num == 3.0) {
+						a.avx(1, OP_VMULPD, top, next, next);
+						a.avx(1, OP_VMULPD, next, next, top);
+					} else a.avx(1, OP_VMULPD, next, next, next);
+					--depth;
+					break;
+				}
+				// Fall through
+			case OPCODE_MOD:
+				spill(a, depth);
+				a.lea(RDI, spillSlot(next));
+				a.lea(RSI, spillSlot(top));
+				if (instr.opcode == OPCODE_POW)
+					call(a, a.single ? (const void*)helperPowFloat : (const void*)helperPow);
+				else call(a, a.single ? (const void*)helperModFloat : (const void*)helperMod);
+				reload(a, --depth);
+				break;
+			case OPCODE_FACTORIAL:
+				spill(a, depth);
+				a.lea(RDI, spillSlot(top));
+				call(a, a.single ? (const void*)helperFactorialFloat : (const void*)helperFactorial);
+				reload(a, depth);
+				break;
+			case OPCODE_CALL: {
+				const Function* function = instr.function;
+				const void* batch = a.single ? (const void*)function->batchFloat : (const void*)function->batch;
+				spill(a, depth);
+				a.lea(RDI, spillSlot(depth - function->args));
+				if (batch) {
+					// The spill slots are one vector apart
+					a.movImm(RSI, lanes);
+					a.movImm(RDX, lanes);
+					a.mov(RCX, RDI);
+					call(a, batch);
+				} else {
+					// Through doubles, or one value at a time
+					a.movImm(RSI, reinterpret_cast<uint64_t>(function));
+					if (!a.single)
+						call(a, (const void*)helperScalar<double, LANES>);
+					else if (function->batch)
+						call(a, (const void*)helperBatchFloat);
+					else call(a, (const void*)helperScalar<float, FLOAT_LANES>);
+				}
+				depth -= function->args - 1;
+				reload(a, depth);
+				break;
+			}
+		}
+	}
+	// Same rounding as the interpreter, but to nearest even on ties. Floats
+	// are stored as they are.
+	if (!a.single)
+		a.vbroadcast(depth, constant(a, NATIVE_ROUNDING));
+	for (int result = 0; result < depth; ++result) {
+		if (!a.single) {
+			a.avx(1, OP_VMULPD, result, result, depth);
+			a.vroundpd(result, result, 0);
+			a.avx(1, OP_VDIVPD, result, result, depth);
+		}
+		a.movLoad(RAX, Mem { REG_OUT, -1, result * 8 });
+		a.vmovupdStore(Mem { RAX, REG_INDEX, 0 }, result);
+	}
+
+	a.addImm(REG_INDEX, lanes);
+	a.cmp(REG_INDEX, REG_COUNT);
+	a.jbBack(loop);
+	a.vzeroupper();
+	a.addImm(RSP, frame);
+	for (int i = 4; i >= 0; --i)
+		a.pop(saved[i]);
+	a.ret();
+
+	std::shared_ptr<NativeCode> native(new NativeCode());
+	native->size = a.code.size();
+	void* memory = mmap(NULL, native->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return NULL;
+	native->memory = memory;
+	memcpy(memory, &a.code[0], native->size);
+	if (mprotect(memory, native->size, PROT_READ | PROT_EXEC) != 0)
+		return NULL;
+	if (a.single)
+		native->floatFunc = reinterpret_cast<NativeFloatFunc>(memory);
+	else native->func = reinterpret_cast<NativeFunc>(memory);
+	native->outputs = depth;
+	return native;
+}
+
+#else
+
+struct NativeCode {
+	NativeFunc func;
+	NativeFloatFunc floatFunc;
+	int outputs;
+};
+
+std::shared_ptr<NativeCode> compileNative(const std::vector<Instruction>&, int, int, int, Precision)
+{
+	return NULL;
+}
+
+#endif
+
+// The generated loop only handles whole vectors, the rest goes through
+// a padded copy
+template<typename T, typename F>
+static void runNative(F func, int outputs, int lanes, const T* values, const T* consts, T* const* out, int count)
+{
+	int full = count / lanes * lanes;
+	if (full)
+		func(values, consts, out, full);
+	if (full < count) {
+		std::vector<T> in(lanes), res(outputs * lanes);
+		std::vector<T*> resOut(outputs);
+		for (int i = 0; i < outputs; ++i)
+			resOut[i] = &res[i * lanes];
+		if (values)
+			std::copy(values + full, values + count, in.begin());
+		func(&in[0], consts, &resOut[0], lanes);
+		for (int i = 0; i < outputs; ++i)
+			std::copy(resOut[i], resOut[i] + count - full, out[i] + full);
+	}
+}
+
+void runNative(const NativeCode& native, const double* values, const double* consts, double* const* out, int count)
+{
+	runNative(native.func, native.outputs, LANES, values, consts, out, count);
+}
+
+void runNative(const NativeCode& native, const float* values, const float* consts, float* const* out, int count)
+{
+	runNative(native.floatFunc, native.outputs, FLOAT_LANES, values, consts, out, count);
+}
+
+} // namespace
@@ -13,6 +13,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <tuple>
 
 namespace calc {
 
@@ -22,18 +26,144 @@ namespace calc {
 	{ "e", M_E }
 };
 
-/*static*/ std::vector<Function> MathExpression::funcs = {
-	{ "abs", fabs },
-	{ "sqrt", sqrt },
-	{ "ln", log },
-	{ "lb", log2 },
-	{ "lg", log10 },
-	{ "log", log10 },
-	{ "cos", cos },
-	{ "sin", sin },
-	{ "tan", tan },
-	{ "exp", exp },
-	{ "rnd", [](double mult) { return mult * rand() / RAND_MAX; } }
+// Functions are structs with an apply() for both precisions, taking the
+// arguments at a[0], a[stride] ...
+
+template<double (*F)(double), float (*G)(float)>
+struct Unary {
+	static double apply(const double* a, int) { return F(a[0]); }
+	static float apply(const float* a, int) { return G(a[0]); }
+};
+
+struct Min {
+	template<typename T> static T apply(const T* a, int stride) { return a[0] < a[stride] ? a[0] : a[stride]; }
+};
+
+struct Max {
+	template<typename T> static T apply(const T* a, int stride) { return a[0] > a[stride] ? a[0] : a[stride]; }
+};
+
+// atan2(y, x)
+struct Atan2 {
+	template<typename T> static T apply(const T* a, int stride) { return atan2(a[0], a[stride]); }
+};
+
+// step(edge, x)
+struct Step {
+	template<typename T> static T apply(const T* a, int stride) { return a[stride] < a[0] ? T(0) : T(1); }
+};
+
+// mix(a, b, t)
+struct Mix {
+	template<typename T> static T apply(const T* a, int stride) { return a[0] + (a[stride] - a[0]) * a[stride * 2]; }
+};
+
+// clamp(x, lo, hi)
+struct Clamp {
+	template<typename T> static T apply(const T* a, int stride) {
+		T x = a[0] > a[stride] ? a[0] : a[stride];
+		return x < a[stride * 2] ? x : a[stride * 2];
+	}
+};
+
+// smoothstep(edge0, edge1, x)
+struct Smoothstep {
+	template<typename T> static T apply(const T* a, int stride) {
+		T t = (a[stride * 2] - a[0]) / (a[stride] - a[0]);
+		t = t < T(0) ? T(0) : t > T(1) ? T(1) : t;
+		return t * t * (T(3) - T(2) * t);
+	}
+};
+
+// rnd(x, y, seed) in [0, 1), a hash of floor(x), floor(y) and the seed
+// rather than the next value of a sequence, so it is pure and can run on
+// any thread. Equal in both precisions for integer arguments.
+struct Random {
+	static unsigned hash(unsigned x) {
+		// lowbias32 by Chris Wellons
+		x ^= x >> 16; x *= 0x7feb352d;
+		x ^= x >> 15; x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	}
+	// Hashing the value before combining keeps keys that differ by little
+	// from giving shifted copies of one row
+	static unsigned combine(unsigned key, unsigned value) { return hash(key ^ hash(value)); }
+	template<typename T> static T apply(const T* a, int stride, T seed) {
+		unsigned key = combine(hash(unsigned(int(seed))), unsigned(int(floor(a[stride]))));
+		unsigned h = combine(key, unsigned(int(floor(a[0]))));
+		return T(h >> 8) * T(1.0 / (1 << 24));
+	}
+};
+
+struct Random2 {
+	template<typename T> static T apply(const T* a, int stride) { return Random::apply(a, stride, T(0)); }
+};
+
+struct Random3 {
+	template<typename T> static T apply(const T* a, int stride) { return Random::apply(a, stride, a[stride * 2]); }
+};
+
+// rnd(m) is always compiled to m * rnd(x, y, seed) with a seed of its own
+// for each use, see apply_function()
+struct Random1 {
+	template<typename T> static T apply(const T* a, int) { T zero[3] = {}; return a[0] * Random::apply(zero, 1, T(-1)); }
+};
+
+template<typename F>
+static double scalar(const double* args) {
+	return F::apply(args, 1);
+}
+
+// Plain loops over the math functions, which compilers vectorize using
+// their SIMD math libraries when allowed to (e.g. with -ffast-math)
+template<typename F, typename T>
+static void batch(const T* in, int stride, int count, T* out) {
+	for (int i = 0; i < count; ++i)
+		out[i] = F::apply(in + i, stride);
+}
+
+template<typename F>
+static Function function(const char* name, int args) {
+	Function f = { name, args, scalar<F>, batch<F, double>, batch<F, float>, true };
+	return f;
+}
+
+/*static*/ std::deque<Function> MathExpression::funcs = {
+	function<Unary<fabs, fabsf>>("abs", 1),
+	function<Unary<sqrt, sqrtf>>("sqrt", 1),
+	function<Unary<log, logf>>("ln", 1),
+	function<Unary<log2, log2f>>("lb", 1),
+	function<Unary<log10, log10f>>("lg", 1),
+	function<Unary<log10, log10f>>("log", 1),
+	function<Unary<cos, cosf>>("cos", 1),
+	function<Unary<sin, sinf>>("sin", 1),
+	function<Unary<tan, tanf>>("tan", 1),
+	function<Unary<exp, expf>>("exp", 1),
+	function<Min>("min", 2),
+	function<Max>("max", 2),
+	function<Atan2>("atan2", 2),
+	function<Step>("step", 2),
+	function<Mix>("mix", 3),
+	function<Clamp>("clamp", 3),
+	function<Smoothstep>("smoothstep", 3),
+	function<Random1>("rnd", 1),
+	function<Random2>("rnd", 2),
+	function<Random3>("rnd", 3)
+};
+
+// How often the inputs of a subexpression change
+enum {
+	LEVEL_CONSTANT,
+	LEVEL_IMAGE,
+	LEVEL_ROW,
+	LEVEL_PIXEL
+};
+
+// Bits of MathExpression::dirty
+enum {
+	STAGE_IMAGE = 1,
+	STAGE_ROW = 2
 };
 
 typedef enum {
@@ -55,19 +185,30 @@ typedef struct {
 	OperatorAssociativity associativity;
 } Operator;
 
+// Operands only exist once the program runs, so compiling just tracks how
+// many there will be and emits the instructions that consume them
 typedef struct {
 	int size;
-	double values[MathExpression::MAX_TOKENS];
+	int maxSize;
+	std::vector<Instruction>* program;
+	std::vector<char>* variables;
+	int* randomCount; // Uses of rnd(m) so far
+	int randomKey; // Stands in for the pixel in rnd(m) when not negative
 } OperandStack;
 
+// The stacks never hold more entries than there are tokens, so they are
+// sized for that up front
 typedef struct {
 	int size;
-	const Operator* values[MathExpression::MAX_TOKENS];
+	std::vector<const Operator*> values;
 } OperatorStack;
 
+// One entry per open parenthesis, with a null function for plain ones
 typedef struct {
 	int size;
-	MathFunc values[MathExpression::MAX_TOKENS];
+	std::vector<const Function*> values;
+	std::vector<int> args; // Arguments so far
+	std::vector<int> operands; // Operands before the first one
 } FunctionStack;
 
 #define STACK_PUSH(stack, value) (stack)->values[(stack)->size++] = (value)
@@ -92,8 +233,8 @@ static const Operator OPERATORS[] = {
 };
 static const char* allopers = "!^*/%+-<>";
 
-// Parses a tokenized expression.
-static Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operators, FunctionStack *functions);
+// Compiles a tokenized expression to postfix instructions.
+static Status compile(const Token *tokens, OperandStack *operands, OperatorStack *operators, FunctionStack *functions);
 
 // Pushes an operator to the stack after applying operators with a higher
 // precedence.
@@ -102,6 +243,9 @@ static Status push_operator(const Operator *op, OperandStack *operands, Operator
 // Pushes the multiplication operator to the stack.
 static Status push_multiplication(OperandStack *operands, OperatorStack *operators);
 
+// Pushes a number to the operands.
+static void push_operand(const Token *token, OperandStack *operands);
+
 // Applies an operator to the top one or two operands, depending on if the
 // operator is unary or binary.
 static Status apply_operator(const Operator *op, OperandStack *operands);
@@ -109,8 +253,9 @@ static Status apply_operator(const Operator *op, OperandStack *operands);
 // Applies a unary operator to the top operand.
 static Status apply_unary_operator(const Operator *op, OperandStack *operands);
 
-// Applies a function to the top operand.
-static Status apply_function(MathFunc function, OperandStack *operands);
+// Applies a function to the top operands, choosing the overload taking
+// that many arguments.
+static Status apply_function(const Function *function, int args, OperandStack *operands);
 
 // Returns the arity of an operator, using the previous token for context.
 static OperatorArity get_arity(char symbol, const Token *previous);
@@ -119,7 +264,7 @@ static OperatorArity get_arity(char symbol, const Token *previous);
 static const Operator *get_operator(char symbol, OperatorArity arity);
 
 
-Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operators, FunctionStack *functions) {
+Status compile(const Token *tokens, OperandStack *operands, OperatorStack *operators, FunctionStack *functions) {
 	Status status = OK;
 	for (const Token *token = tokens, *previous = &NO_TOKEN, *next = token + 1;
 		 token->type != TOKEN_NONE; previous = token, token = next++) {
@@ -130,6 +275,9 @@ Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operator
 					status = push_multiplication(operands, operators);
 
 				STACK_PUSH(operators, get_operator('(', OPERATOR_OTHER));
+				functions->args[functions->size] = 1;
+				functions->operands[functions->size] = operands->size;
+				STACK_PUSH(functions, previous->type == TOKEN_IDENTIFIER ? previous->func : NULL);
 				break;
 
 			case TOKEN_CLOSE_PARENTHESIS: {
@@ -144,8 +292,30 @@ Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operator
 				}
 				if (!found_parenthesis)
 					status = ERROR_CLOSE_PARENTHESIS;
-				else if (functions->size)
-					status = apply_function(STACK_POP(functions), operands);
+				else if (functions->size) {
+					const int args = functions->args[functions->size - 1];
+					const int first = functions->operands[functions->size - 1];
+					const Function *function = STACK_POP(functions);
+					if (function && operands->size != first + args)
+						status = ERROR_FUNCTION_ARGUMENTS;
+					else if (function)
+						status = apply_function(function, args, operands);
+				}
+				break;
+			}
+
+			case TOKEN_COMMA: {
+				// Completes an argument, applying operators back to the
+				// parenthesis of the function
+				while (operators->size && status == OK && STACK_TOP(operators)->symbol != '(')
+					status = apply_operator(STACK_POP(operators), operands);
+				if (status != OK)
+					break;
+				if (!operators->size || !functions->size || !STACK_TOP(functions))
+					status = ERROR_SYNTAX;
+				else if (operands->size != functions->operands[functions->size - 1] + functions->args[functions->size - 1])
+					status = ERROR_FUNCTION_ARGUMENTS;
+				else functions->args[functions->size - 1]++;
 				break;
 			}
 
@@ -157,7 +327,7 @@ Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operator
 				if (previous->type == TOKEN_CLOSE_PARENTHESIS || previous->type == TOKEN_IDENTIFIER)
 					status = ERROR_SYNTAX;
 				else {
-					STACK_PUSH(operands, token->num);
+					push_operand(token, operands);
 
 					// Implicit multiplication: "2(2)" or "2a".
 					if (next->type == TOKEN_OPEN_PARENTHESIS ||
@@ -169,8 +339,7 @@ Status eval(const Token *tokens, OperandStack *operands, OperatorStack *operator
 
 			case TOKEN_IDENTIFIER:
 				if (next->type == TOKEN_OPEN_PARENTHESIS) {
-					STACK_PUSH(functions, token->func);
-					status = OK;
+					status = OK; // Pushed with the parenthesis
 				} else if (next->type == TOKEN_OPEN_PARENTHESIS ||
 						   next->type == TOKEN_IDENTIFIER ||
 						   next->type == TOKEN_NUMBER) {
@@ -220,64 +389,112 @@ Status push_multiplication(OperandStack *operands, OperatorStack *operators) {
 	return push_operator(get_operator('*', OPERATOR_BINARY), operands, operators);
 }
 
+void push_operand(const Token *token, OperandStack *operands) {
+	Instruction instr = {OPCODE_PUSH, NULL, token->num, -1, true};
+	if (token->var) {
+		// Variables get a slot in order of appearance
+		std::vector<char>& vars = *operands->variables;
+		instr.opcode = OPCODE_LOAD;
+		instr.slot = std::find(vars.begin(), vars.end(), token->var) - vars.begin();
+		if (instr.slot == (int)vars.size())
+			vars.push_back(token->var);
+	}
+	operands->program->push_back(instr);
+	if (++operands->size > operands->maxSize)
+		operands->maxSize = operands->size;
+}
+
 Status apply_operator(const Operator *op, OperandStack *operands) {
 	if (!op || !operands->size)
 		return ERROR_SYNTAX;
 	if (op->arity == OPERATOR_UNARY)
 		return apply_unary_operator(op, operands);
 
-	double y = STACK_POP(operands);
-	if (!operands->size)
+	if (operands->size < 2)
 		return ERROR_SYNTAX;
-	double x = STACK_POP(operands);
-	Status status = OK;
+	Instruction instr = {OPCODE_POW, NULL, 0, -1, true};
 	switch (op->symbol) {
-		case '^': x = pow(x, y); break;
-		case '*': x = x * y; break;
-		case '/': x = x / y; break;
-		case '%': x = fmod(x, y); break;
-		case '+': x = x + y; break;
-		case '-': x = x - y; break;
-		case '<': x = x < y ? 1.0 : 0.0; break;
-		case '>': x = x > y ? 1.0 : 0.0; break;
+		case '^': instr.opcode = OPCODE_POW; break;
+		case '*': instr.opcode = OPCODE_MUL; break;
+		case '/': instr.opcode = OPCODE_DIV; break;
+		case '%': instr.opcode = OPCODE_MOD; break;
+		case '+': instr.opcode = OPCODE_ADD; break;
+		case '-': instr.opcode = OPCODE_SUB; break;
+		case '<': instr.opcode = OPCODE_LESS; break;
+		case '>': instr.opcode = OPCODE_GREATER; break;
 		default: return ERROR_UNRECOGNIZED;
 	}
-	STACK_PUSH(operands, x);
-	return status;
+	operands->program->push_back(instr);
+	operands->size--;
+	return OK;
 }
 
 Status apply_unary_operator(const Operator *op, OperandStack *operands) {
-	double x = STACK_POP(operands);
+	Instruction instr = {OPCODE_NEG, NULL, 0, -1, true};
 	switch (op->symbol) {
 		case '+':
-			break;
+			return OK;
 		case '-':
-			x = -x;
+			instr.opcode = OPCODE_NEG;
 			break;
 		case '!':
-			x = tgamma(x + 1);
+			instr.opcode = OPCODE_FACTORIAL;
 			break;
 		default:
 			return ERROR_UNRECOGNIZED;
 	}
-	STACK_PUSH(operands, x);
+	operands->program->push_back(instr);
 	return OK;
 }
 
-Status apply_function(MathFunc function, OperandStack *operands) {
-	if (!operands->size)
-		return ERROR_FUNCTION_ARGUMENTS;
+static const Function *find_overload(const char *name, int args) {
+	const Function *overload = NULL;
+	for (const Function& f : MathExpression::funcs) {
+		if (f.args == args && strcmp(f.name, name) == 0)
+			overload = &f;
+	}
+	return overload;
+}
+
+Status apply_function(const Function *function, int args, OperandStack *operands) {
 	if (!function)
 		return ERROR_UNDEFINED_FUNCTION;
-	double x = STACK_POP(operands);
-	x = function(x);
-	STACK_PUSH(operands, x);
+	if (function->args != args)
+		function = find_overload(function->name, args);
+	if (!function || operands->size < args)
+		return ERROR_FUNCTION_ARGUMENTS;
+	const Function *random = args == 1 && strcmp(function->name, "rnd") == 0 ? find_overload("rnd", 3) : NULL;
+	if (random) {
+		// rnd(m) becomes m * rnd(x, y, seed), a hash of the pixel rather than
+		// the next value of rand(). Negative seeds keep apart from the ones
+		// written as rnd(x, y, seed). Without a pixel the key takes its place.
+		Token x = {TOKEN_NUMBER, NULL, 0, 0, 'x'};
+		Token y = {TOKEN_NUMBER, NULL, 0, 0, 'y'};
+		if (operands->randomKey >= 0) {
+			x.num = operands->randomKey;
+			x.var = y.var = 0;
+		}
+		const Token seed = {TOKEN_NUMBER, NULL, -1.0 - (*operands->randomCount)++, 0, 0};
+		push_operand(&x, operands);
+		push_operand(&y, operands);
+		push_operand(&seed, operands);
+		Instruction call = {OPCODE_CALL, random, 0, -1, random->pure};
+		Instruction mul = {OPCODE_MUL, NULL, 0, -1, true};
+		operands->program->push_back(call);
+		operands->program->push_back(mul);
+		operands->size -= 3;
+		return OK;
+	}
+	Instruction instr = {OPCODE_CALL, function, 0, -1, function->pure};
+	operands->program->push_back(instr);
+	operands->size -= args - 1;
 	return OK;
 }
 
 OperatorArity get_arity(char symbol, const Token *previous) {
 	if (symbol == '!' || previous->type == TOKEN_NONE ||
 			previous->type == TOKEN_OPEN_PARENTHESIS ||
+			previous->type == TOKEN_COMMA ||
 			(previous->type == TOKEN_OPERATOR && previous->op != '!'))
 		return OPERATOR_UNARY;
 	return OPERATOR_BINARY;
@@ -291,9 +508,25 @@ const Operator *get_operator(char symbol, OperatorArity arity) {
 	return NULL;
 }
 
-MathExpression::MathExpression(const std::string& expr)
+MathExpression::MathExpression(const std::string& expr): context(*this)
+{
+	parse(expr);
+	compile();
+}
+
+MathExpression::MathExpression(const std::vector<std::string>& exprs): context(*this)
 {
-	int length = 0;
+	for (const std::string& expr : exprs)
+		parse(expr);
+	compile();
+}
+
+// Tokenizes an expression and appends its instructions to the source
+void MathExpression::parse(const std::string& expr)
+{
+	// At most one token per character, plus the terminator
+	std::vector<Token> tokens;
+	tokens.reserve(expr.size() + 1);
 	const char *c = expr.c_str();
 	while (*c) {
 		Token token = {TOKEN_UNKNOWN, NULL, 0, 0, 0};
@@ -302,6 +535,8 @@ MathExpression::MathExpression(const std::string& expr)
 			token.type = TOKEN_OPEN_PARENTHESIS;
 		else if (*c == ')')
 			token.type = TOKEN_CLOSE_PARENTHESIS;
+		else if (*c == ',')
+			token.type = TOKEN_COMMA;
 		else if (strchr(allopers, *c)) {
 			token.type = TOKEN_OPERATOR;
 			token.op = *c;
@@ -309,26 +544,22 @@ MathExpression::MathExpression(const std::string& expr)
 			token.type = TOKEN_NUMBER;
 			token.num = std::stod(c, &tokenLength);
 		} else if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')) {
-			// Check constant
+			// The longest constant or function name, so that e.g. "exp" is
+			// not read as "e" followed by "xp"
 			for (auto& constant : consts) {
-				int l = strlen(constant.name);
-				if (strncmp(c, constant.name, l) == 0) {
+				size_t l = strlen(constant.name);
+				if (l > tokenLength && strncmp(c, constant.name, l) == 0) {
 					token.type = TOKEN_NUMBER;
 					token.num = constant.value;
 					tokenLength = l;
-					break;
 				}
 			}
-			// Check function
-			if (!tokenLength) {
-				for (auto& f : funcs) {
-					int l = strlen(f.name);
-					if (strncmp(c, f.name, l) == 0) {
-						token.type = TOKEN_IDENTIFIER;
-						token.func = f.func;
-						tokenLength = l;
-						break;
-					}
+			for (auto& f : funcs) {
+				size_t l = strlen(f.name);
+				if (l > tokenLength && strncmp(c, f.name, l) == 0) {
+					token.type = TOKEN_IDENTIFIER;
+					token.func = &f;
+					tokenLength = l;
 				}
 			}
 			// Assume variable
@@ -339,38 +570,509 @@ MathExpression::MathExpression(const std::string& expr)
 			}
 		}
 		if (!isspace(*c)) {
-			tokens[length++] = token;
+			tokens.push_back(token);
 		}
 		c += tokenLength ? tokenLength : 1;
 	}
-	tokens[length] = NO_TOKEN;
+	tokens.push_back(NO_TOKEN);
+
+	// On errors the program is cut short, eval() still runs what was
+	// compiled up to that point
+	OperandStack operands; operands.size = 0; operands.maxSize = 0;
+	operands.program = &source; operands.variables = &varNames;
+	operands.randomCount = &randomCount; operands.randomKey = randomKey;
+	OperatorStack operators; operators.size = 0;
+	operators.values.resize(tokens.size());
+	FunctionStack functions; functions.size = 0;
+	functions.values.resize(tokens.size());
+	functions.args.resize(tokens.size());
+	functions.operands.resize(tokens.size());
+	Status result = calc::compile(&tokens[0], &operands, &operators, &functions);
+	if (!operands.size && result == OK)
+		result = ERROR_NO_INPUT;
+	if (status == OK)
+		status = result;
+	// The results of earlier expressions stay below on the stack
+	maxStackSize = std::max(maxStackSize, stackSize + operands.maxSize);
+	stackSize += operands.size;
+	++outputs;
 }
 
-void MathExpression::setVar(char var, double value)
+void MathExpression::compile()
 {
-	int i = 0;
-	while (tokens[i].type != TOKEN_NONE) {
-		Token& token = tokens[i];
-		if (token.type == TOKEN_NUMBER && token.var == var)
-			token.num = value;
-		++i;
+	varLevels.assign(varNames.size(), LEVEL_PIXEL);
+	slotStages.assign(varNames.size(), 0);
+	xSlot = getSlot('x');
+	ySlot = getSlot('y');
+	sourceStackSize = std::max(maxStackSize, 1);
+	optimize();
+}
+
+// Expression tree of the compiled program for the optimizer
+struct MathExpression::Node {
+	Instruction instr;
+	int args[Function::MAX_ARGS];
+	int argCount;
+	int level;
+	int uses; // Parents referring to the node, equal subtrees are merged
+};
+
+static int get_argument_count(const Instruction& instr) {
+	switch (instr.opcode) {
+		case OPCODE_PUSH:
+		case OPCODE_LOAD:
+		case OPCODE_REUSE:
+			return 0;
+		case OPCODE_NEG:
+		case OPCODE_FACTORIAL:
+		case OPCODE_STORE:
+		case OPCODE_KEEP:
+			return 1;
+		case OPCODE_CALL:
+			return instr.function->args;
+		default:
+			return 2;
+	}
+}
+
+static int get_stack_size(const std::vector<Instruction>& program) {
+	int size = 0, maxSize = 0;
+	for (const Instruction& instr : program) {
+		size += 1 - get_argument_count(instr) - (instr.opcode == OPCODE_STORE);
+		maxSize = std::max(maxSize, size);
 	}
+	return maxSize;
 }
 
-double MathExpression::eval(Status* status)
+// Runs a program with the scalar interpreter, returns the number of values
+// left on the stack
+static int execute(const std::vector<Instruction>& program, double* vars, double* temps, double* stack) {
+	double* top = stack - 1;
+	for (const Instruction& instr : program) {
+		switch (instr.opcode) {
+			case OPCODE_PUSH: *++top = instr.num; break;
+			case OPCODE_LOAD: *++top = vars[instr.slot]; break;
+			case OPCODE_STORE: vars[instr.slot] = *top--; break;
+			case OPCODE_KEEP: temps[instr.slot] = *top; break;
+			case OPCODE_REUSE: *++top = temps[instr.slot]; break;
+			case OPCODE_NEG: *top = -*top; break;
+			case OPCODE_FACTORIAL: *top = tgamma(*top + 1); break;
+			case OPCODE_POW: --top; *top = pow(top[0], top[1]); break;
+			case OPCODE_MUL: --top; *top = top[0] * top[1]; break;
+			case OPCODE_DIV: --top; *top = top[0] / top[1]; break;
+			case OPCODE_MOD: --top; *top = fmod(top[0], top[1]); break;
+			case OPCODE_ADD: --top; *top = top[0] + top[1]; break;
+			case OPCODE_SUB: --top; *top = top[0] - top[1]; break;
+			case OPCODE_LESS: --top; *top = top[0] < top[1] ? 1.0 : 0.0; break;
+			case OPCODE_GREATER: --top; *top = top[0] > top[1] ? 1.0 : 0.0; break;
+			case OPCODE_CALL:
+				top -= instr.function->args - 1;
+				*top = instr.function->func(top);
+				break;
+		}
+	}
+	return top + 1 - stack;
+}
+
+void MathExpression::optimize()
 {
-	OperandStack operands; operands.size = 0;
-	OperatorStack operators; operators.size = 0;
-	FunctionStack functions; functions.size = 0;
-	Status err = calc::eval(tokens, &operands, &operators, &functions);
-	double result = 0.0;
-	if (operands.size)
-		result = round(STACK_POP(&operands) * 10e14) / 10e14;
-	else if (err == OK)
-		err = ERROR_NO_INPUT;
+	program.clear();
+	stages[0].clear();
+	stages[1].clear();
+	slotCount = varNames.size();
+	tempCount = 0;
+	native = NULL;
+	context.dirty = ~0;
+	// Programs cut short by errors are left as they are
+	if (status != OK || stackSize != outputs) {
+		program = source;
+		context.vars.resize(slotCount);
+		return;
+	}
+	// Builds the tree bottom up, looking up each node among the earlier ones
+	// so that a subexpression repeated within or across the expressions
+	// becomes a single node. Impure calls are never merged.
+	typedef std::tuple<int, double, int, const Function*, int, int, int> Key;
+	std::map<Key, int> merged;
+	std::vector<Node> nodes;
+	std::vector<int> stack;
+	for (const Instruction& instr : source) {
+		Node node = { instr, { -1, -1, -1 }, get_argument_count(instr), LEVEL_CONSTANT, 0 };
+		for (int i = node.argCount - 1; i >= 0; --i) {
+			node.args[i] = stack.back();
+			stack.pop_back();
+			node.level = std::max(node.level, nodes[node.args[i]].level);
+		}
+		if (instr.opcode == OPCODE_LOAD)
+			node.level = varLevels[instr.slot];
+		else if (!instr.pure)
+			node.level = LEVEL_PIXEL;
+		Key key(instr.opcode, instr.num, instr.slot, instr.function, node.args[0], node.args[1], node.args[2]);
+		auto it = instr.pure ? merged.find(key) : merged.end();
+		if (it == merged.end()) {
+			for (int i = 0; i < node.argCount; ++i)
+				nodes[node.args[i]].uses++;
+			if (instr.pure)
+				merged[key] = nodes.size();
+			stack.push_back(nodes.size());
+			nodes.push_back(node);
+		} else stack.push_back(it->second);
+	}
+	std::vector<int> emitted(nodes.size(), -1);
+	for (int root : stack)
+		nodes[root].uses++;
+	for (int root : stack)
+		emit(nodes, root, LEVEL_PIXEL, program, emitted);
+	maxStackSize = get_stack_size(program);
+	context.vars.resize(slotCount);
+}
+
+// Emits the code of a subtree to run at the given level. Parts of it that
+// can run at an earlier level are folded to constants or moved to a stage.
+// Nodes with several uses are computed once and then reloaded, emitted
+// holds where: a variable slot, or -2 - temporary for per pixel values.
+// The tree is walked with a stack of its own rather than by recursion, as
+// long expressions nest deeper than the call stack allows.
+void MathExpression::emit(const std::vector<Node>& nodes, int root, int level, std::vector<Instruction>& out, std::vector<int>& emitted)
+{
+	enum { EMIT_PLAIN, EMIT_FOLD, EMIT_STAGE };
+	struct Frame {
+		int index;
+		int mode;
+		int level; // Of the arguments
+		std::vector<Instruction>* out; // Of the result
+		std::vector<Instruction>* code; // Of the arguments
+		int arg; // Next argument to emit
+		int slot; // Of EMIT_STAGE
+		size_t start; // Of EMIT_FOLD, where the code to fold begins
+	};
+	std::vector<Frame> frames;
+	auto enter = [&](int index, int level, std::vector<Instruction>& out) {
+		const Node& node = nodes[index];
+		if (emitted[index] != -1) {
+			Instruction load = { OPCODE_LOAD, NULL, 0, emitted[index], true };
+			if (emitted[index] < -1) {
+				load.opcode = OPCODE_REUSE;
+				load.slot = -2 - emitted[index];
+			}
+			out.push_back(load);
+			return;
+		}
+		Frame frame = { index, EMIT_PLAIN, level, &out, &out, 0, -1, out.size() };
+		if (node.argCount && node.level < level) {
+			if (node.level == LEVEL_CONSTANT) {
+				// Emitted in place, then run and replaced by the result
+				frame.mode = EMIT_FOLD;
+				frame.level = LEVEL_CONSTANT;
+			} else {
+				// The stage stores the result in a new slot after the variables
+				frame.mode = EMIT_STAGE;
+				frame.level = node.level;
+				frame.code = &stages[node.level - LEVEL_IMAGE];
+				frame.slot = slotCount++;
+			}
+		}
+		frames.push_back(frame);
+	};
+	std::vector<double> stack(sourceStackSize);
+	enter(root, level, out);
+	while (!frames.empty()) {
+		Frame& top = frames.back();
+		const Node& node = nodes[top.index];
+		if (top.arg < node.argCount) {
+			const int arg = node.args[top.arg++];
+			enter(arg, top.level, *top.code);
+			continue;
+		}
+		const Frame frame = top;
+		frames.pop_back();
+		if (frame.mode == EMIT_FOLD) {
+			std::vector<Instruction> code(frame.out->begin() + frame.start, frame.out->end());
+			code.push_back(node.instr);
+			execute(code, NULL, NULL, &stack[0]);
+			frame.out->resize(frame.start);
+			Instruction push = { OPCODE_PUSH, NULL, stack[0], -1, true };
+			frame.out->push_back(push);
+		} else if (frame.mode == EMIT_STAGE) {
+			Instruction store = { OPCODE_STORE, NULL, 0, frame.slot, true };
+			Instruction load = { OPCODE_LOAD, NULL, 0, frame.slot, true };
+			frame.code->push_back(node.instr);
+			frame.code->push_back(store);
+			frame.out->push_back(load);
+			emitted[frame.index] = frame.slot;
+		} else {
+			std::vector<Instruction>& out = *frame.out;
+			out.push_back(node.instr);
+			if (node.uses > 1 && node.argCount && frame.level > LEVEL_CONSTANT) {
+				if (frame.level == LEVEL_PIXEL) {
+					Instruction keep = { OPCODE_KEEP, NULL, 0, tempCount, true };
+					out.push_back(keep);
+					emitted[frame.index] = -2 - tempCount++;
+				} else {
+					Instruction store = { OPCODE_STORE, NULL, 0, slotCount, true };
+					Instruction load = { OPCODE_LOAD, NULL, 0, slotCount++, true };
+					out.push_back(store);
+					out.push_back(load);
+					emitted[frame.index] = load.slot;
+				}
+			}
+		}
+	}
+}
+
+void MathExpression::hoist(const std::string& imageVars, const std::string& rowVars)
+{
+	for (size_t i = 0; i < varNames.size(); ++i) {
+		if (imageVars.find(varNames[i]) != std::string::npos) {
+			varLevels[i] = LEVEL_IMAGE;
+			slotStages[i] = STAGE_IMAGE | STAGE_ROW;
+		} else if (rowVars.find(varNames[i]) != std::string::npos) {
+			varLevels[i] = LEVEL_ROW;
+			slotStages[i] = STAGE_ROW;
+		} else {
+			varLevels[i] = LEVEL_PIXEL;
+			slotStages[i] = 0;
+		}
+	}
+	optimize();
+}
+
+int MathExpression::getSlot(char var) const
+{
+	for (size_t i = 0; i < varNames.size(); ++i) {
+		if (varNames[i] == var)
+			return i;
+	}
+	return -1;
+}
+
+bool MathExpression::compileNative(char var, Precision precision)
+{
+	nativeSlot = getSlot(var);
+	nativePrecision = precision;
+	context.nativeConsts.clear();
+	context.nativeFloatConsts.clear();
+	native = status == OK ? calc::compileNative(program, nativeSlot, slotCount, maxStackSize, precision) : NULL;
+	if (native) {
+		nativeConsts.resize(NATIVE_CONSTS + slotCount + program.size());
+		nativeConsts[NATIVE_ONE] = 1.0;
+		nativeConsts[NATIVE_SIGN] = -0.0;
+		nativeConsts[NATIVE_ROUNDING] = 10e14;
+		for (size_t i = 0; i < program.size(); ++i)
+			nativeConsts[NATIVE_CONSTS + slotCount + i] = program[i].num;
+	}
+	return native != NULL;
+}
+
+MathContext::MathContext(const MathExpression& expr): expr(&expr), dirty(~0)
+{
+	// The expression's own context is created before the program
+	if (&expr.context != this)
+		vars = expr.context.vars;
+}
+
+void MathContext::setVar(char var, double value)
+{
+	int slot = expr->getSlot(var);
+	if (slot >= 0)
+		setSlot(slot, value);
+}
+
+void MathContext::update()
+{
+	stack.resize(expr->sourceStackSize);
+	if (dirty & STAGE_IMAGE)
+		execute(expr->stages[0], vars.data(), NULL, &stack[0]);
+	if (dirty & STAGE_ROW)
+		execute(expr->stages[1], vars.data(), NULL, &stack[0]);
+	dirty = 0;
+}
+
+double MathContext::eval(Status* status)
+{
+	if (expr->outputs == 1) {
+		double result;
+		eval(&result, status);
+		return result;
+	}
+	std::vector<double> results(expr->outputs);
+	eval(&results[0], status);
+	return results[0];
+}
+
+void MathContext::eval(double* results, Status* status)
+{
+	const MathExpression& e = *expr;
+	if (status)
+		*status = e.status;
+	std::fill(results, results + e.outputs, 0.0);
+	if (!e.stackSize)
+		return;
+	if (dirty)
+		update();
+	stack.resize(e.sourceStackSize);
+	temps.resize(e.tempCount);
+	// The last values on the stack, in case errors left others below them
+	int depth = execute(e.program, vars.data(), temps.data(), &stack[0]);
+	for (int i = std::max(e.outputs - depth, 0); i < e.outputs; ++i)
+		results[i] = round(stack[depth - e.outputs + i] * 10e14) / 10e14;
+}
+
+/*static*/ double MathExpression::eval(const std::string& expr, Status* status)
+{
+	// Runs the program as compiled, for parameters and such optimizing it
+	// would cost more than it saves
+	// Each evaluation hashes rnd(m) with a number of its own, so that random
+	// parameters differ from one another
+	static std::atomic<unsigned> evaluations(0);
+	MathExpression e;
+	e.randomKey = evaluations++ & 0x7fffffff;
+	e.parse(expr);
 	if (status)
-		*status = err;
-	return result;
+		*status = e.status;
+	if (!e.stackSize)
+		return 0.0;
+	std::vector<double> values(e.varNames.size() + e.maxStackSize);
+	double* stack = &values[e.varNames.size()];
+	int depth = execute(e.source, values.data(), NULL, stack);
+	return depth < e.outputs ? 0.0 : round(stack[depth - e.outputs] * 10e14) / 10e14;
+}
+
+static inline double finish(double value) { return round(value * 10e14) / 10e14; }
+static inline float finish(float value) { return value; }
+
+// Calls a function on blocks of arguments, the result replaces the first
+static void call(const Function* function, double* args, int count) {
+	const int stride = MathExpression::BLOCK_SIZE;
+	if (function->batch) {
+		function->batch(args, stride, count, args);
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		double a[Function::MAX_ARGS];
+		for (int j = 0; j < function->args; ++j)
+			a[j] = args[j * stride + i];
+		args[i] = function->func(a);
+	}
+}
+
+static void call(const Function* function, float* args, int count) {
+	const int stride = MathExpression::BLOCK_SIZE;
+	if (function->batchFloat) {
+		function->batchFloat(args, stride, count, args);
+		return;
+	}
+	double in[Function::MAX_ARGS * MathExpression::BLOCK_SIZE];
+	std::copy(args, args + function->args * stride, in);
+	call(function, in, count);
+	std::copy(in, in + count, args);
+}
+
+void MathContext::eval(char var, const double* values, int count, double* out)
+{
+	const MathExpression& e = *expr;
+	if (!e.stackSize) {
+		std::fill(out, out + e.outputs * count, 0.0);
+		return;
+	}
+	if (dirty)
+		update();
+	if (e.native && e.nativePrecision == PRECISION_DOUBLE && e.getSlot(var) == e.nativeSlot) {
+		std::vector<double*> outs(e.outputs);
+		for (int i = 0; i < e.outputs; ++i)
+			outs[i] = out + i * count;
+		if (nativeConsts.size() != e.nativeConsts.size())
+			nativeConsts = e.nativeConsts;
+		std::copy(vars.begin(), vars.end(), nativeConsts.begin() + NATIVE_CONSTS);
+		runNative(*e.native, values, &nativeConsts[0], &outs[0], count);
+		return;
+	}
+	run(var, values, count, out, blocks, temps);
+}
+
+void MathContext::eval(char var, const float* values, int count, float* out)
+{
+	const MathExpression& e = *expr;
+	if (!e.stackSize) {
+		std::fill(out, out + e.outputs * count, 0.f);
+		return;
+	}
+	if (dirty)
+		update();
+	if (e.native && e.nativePrecision == PRECISION_FLOAT && e.getSlot(var) == e.nativeSlot) {
+		std::vector<float*> outs(e.outputs);
+		for (int i = 0; i < e.outputs; ++i)
+			outs[i] = out + i * count;
+		if (nativeFloatConsts.size() != e.nativeConsts.size())
+			nativeFloatConsts.assign(e.nativeConsts.begin(), e.nativeConsts.end());
+		std::copy(vars.begin(), vars.end(), nativeFloatConsts.begin() + NATIVE_CONSTS);
+		runNative(*e.native, values, &nativeFloatConsts[0], &outs[0], count);
+		return;
+	}
+	run(var, values, count, out, floatBlocks, floatTemps);
+}
+
+// The block interpreter of batch evaluation in either precision
+template<typename T>
+void MathContext::run(char var, const T* values, int count, T* out, std::vector<T>& blocks, std::vector<T>& temps)
+{
+	const MathExpression& e = *expr;
+	const int BLOCK_SIZE = MathExpression::BLOCK_SIZE;
+	const int slot = e.getSlot(var);
+	blocks.resize(e.maxStackSize * BLOCK_SIZE);
+	temps.resize(e.tempCount * BLOCK_SIZE);
+	for (int start = 0; start < count; start += BLOCK_SIZE) {
+		const int n = std::min(BLOCK_SIZE, count - start);
+		T* top = &blocks[0] - BLOCK_SIZE;
+		for (const Instruction& instr : e.program) {
+			T* a = top - BLOCK_SIZE;
+			T* b = top;
+			switch (instr.opcode) {
+				case OPCODE_PUSH:
+					top += BLOCK_SIZE;
+					std::fill(top, top + n, T(instr.num));
+					break;
+				case OPCODE_LOAD:
+					top += BLOCK_SIZE;
+					if (instr.slot == slot)
+						std::copy(values + start, values + start + n, top);
+					else std::fill(top, top + n, T(vars[instr.slot]));
+					break;
+				case OPCODE_STORE: break; // Only in the stages
+				case OPCODE_KEEP: std::copy(b, b + n, &temps[instr.slot * BLOCK_SIZE]); break;
+				case OPCODE_REUSE:
+					top += BLOCK_SIZE;
+					std::copy(&temps[instr.slot * BLOCK_SIZE], &temps[instr.slot * BLOCK_SIZE] + n, top);
+					break;
+				case OPCODE_NEG: for (int i = 0; i < n; ++i) b[i] = -b[i]; break;
+				case OPCODE_FACTORIAL: for (int i = 0; i < n; ++i) b[i] = tgamma(b[i] + 1); break;
+				case OPCODE_POW: for (int i = 0; i < n; ++i) a[i] = pow(a[i], b[i]); top = a; break;
+				case OPCODE_MUL: for (int i = 0; i < n; ++i) a[i] = a[i] * b[i]; top = a; break;
+				case OPCODE_DIV: for (int i = 0; i < n; ++i) a[i] = a[i] / b[i]; top = a; break;
+				case OPCODE_MOD: for (int i = 0; i < n; ++i) a[i] = fmod(a[i], b[i]); top = a; break;
+				case OPCODE_ADD: for (int i = 0; i < n; ++i) a[i] = a[i] + b[i]; top = a; break;
+				case OPCODE_SUB: for (int i = 0; i < n; ++i) a[i] = a[i] - b[i]; top = a; break;
+				case OPCODE_LESS: for (int i = 0; i < n; ++i) a[i] = a[i] < b[i] ? T(1) : T(0); top = a; break;
+				case OPCODE_GREATER: for (int i = 0; i < n; ++i) a[i] = a[i] > b[i] ? T(1) : T(0); top = a; break;
+				case OPCODE_CALL:
+					top -= (instr.function->args - 1) * BLOCK_SIZE;
+					call(instr.function, top, n);
+					break;
+			}
+		}
+		// The last values on the stack, in case errors left others below them
+		int depth = (top - &blocks[0]) / BLOCK_SIZE + 1;
+		for (int k = 0; k < e.outputs; ++k) {
+			T* result = out + k * count + start;
+			if (k < e.outputs - depth) {
+				std::fill(result, result + n, T(0));
+				continue;
+			}
+			const T* value = &blocks[(depth - e.outputs + k) * BLOCK_SIZE];
+			for (int i = 0; i < n; ++i)
+				result[i] = finish(value[i]);
+		}
+	}
 }
 
 } // namespace
@@ -8,6 +8,8 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <deque>
 
 namespace calc {
 
@@ -24,11 +26,21 @@ enum Status {
 };
 
 // std::function is much slower...
-typedef double (*MathFunc)(double);
+typedef double (*MathFunc)(const double* args);
+// Applies a function to count values at once, argument j of value i being
+// in[j * stride + i]. out may be the same as in.
+typedef void (*BatchFunc)(const double* in, int stride, int count, double* out);
+typedef void (*BatchFloatFunc)(const float* in, int stride, int count, float* out);
 
 struct Function {
 	const char* name;
+	int args; // 1 to MAX_ARGS, functions can be overloaded by this
 	MathFunc func;
+	BatchFunc batch; // Optional, func is called for each value otherwise
+	BatchFloatFunc batchFloat; // Optional, batch is called through doubles otherwise
+	bool pure; // Same result for the same input, so calls can be folded or hoisted
+
+	static const int MAX_ARGS = 3;
 };
 
 struct Constant {
@@ -42,36 +54,203 @@ enum TokenType {
 	TOKEN_OPEN_PARENTHESIS,
 	TOKEN_CLOSE_PARENTHESIS,
 	TOKEN_OPERATOR,
+	TOKEN_COMMA,
 	TOKEN_NUMBER,
 	TOKEN_IDENTIFIER
 };
 
 struct Token {
 	TokenType type;
-	MathFunc func;
+	const Function* func;
 	double num;
 	char op;
 	char var;
 };
 
+enum Opcode {
+	OPCODE_PUSH,
+	OPCODE_LOAD, // Pushes a variable
+	OPCODE_STORE, // Pops into a variable
+	OPCODE_KEEP, // Copies the top value to a per pixel temporary
+	OPCODE_REUSE, // Pushes a temporary
+	OPCODE_NEG,
+	OPCODE_FACTORIAL,
+	OPCODE_POW,
+	OPCODE_MUL,
+	OPCODE_DIV,
+	OPCODE_MOD,
+	OPCODE_ADD,
+	OPCODE_SUB,
+	OPCODE_LESS,
+	OPCODE_GREATER,
+	OPCODE_CALL
+};
+
+// One step of the compiled postfix program
+struct Instruction {
+	Opcode opcode;
+	const Function* function; // Of OPCODE_CALL
+	double num;
+	int slot; // Variable of OPCODE_LOAD and OPCODE_STORE, temporary of OPCODE_KEEP and OPCODE_REUSE
+	bool pure;
+};
+
+// Batch evaluation in float skips the rounding of results and fits twice
+// as many values in a SIMD register. Scalar evaluation is always in double.
+enum Precision {
+	PRECISION_DOUBLE,
+	PRECISION_FLOAT
+};
+
+// Machine code for batch evaluation, see shunting-yard-jit.cpp. count must
+// be a multiple of the vector width, consts holds the fixed values below
+// followed by the variable slots and then the number of every instruction
+// of the program. Each value left on the stack by the program goes to its
+// own out array.
+typedef void (*NativeFunc)(const double* values, const double* consts, double* const* out, long count);
+typedef void (*NativeFloatFunc)(const float* values, const float* consts, float* const* out, long count);
+enum { NATIVE_ONE, NATIVE_SIGN, NATIVE_ROUNDING, NATIVE_CONSTS };
+struct NativeCode;
+
+// Returns null where native code is not supported. values are used for
+// the variable in slot, the others come from consts.
+std::shared_ptr<NativeCode> compileNative(const std::vector<Instruction>& program, int slot, int slotCount, int maxStackSize, Precision precision);
+// Runs native code on any count
+void runNative(const NativeCode& native, const double* values, const double* consts, double* const* out, int count);
+void runNative(const NativeCode& native, const float* values, const float* consts, float* const* out, int count);
+
+struct MathExpression;
+
+// Evaluation state of an expression for one thread: the variable values,
+// the results of the hoisted stages and scratch space. Expressions are only
+// read once compiled, so any number of contexts can evaluate one at a time.
+// A context starts with the variable values set on the expression itself
+// and must be created after hoist() and compileNative().
+struct MathContext
+{
+	explicit MathContext(const MathExpression& expr);
+	void setSlot(int slot, double value);
+	void setVar(char var, double value);
+	// Sets the per pixel inputs x and y
+	void bind(double x, double y);
+	// See MathExpression
+	double eval(Status* status = 0);
+	void eval(double* results, Status* status = 0);
+	void eval(char var, const double* values, int count, double* out);
+	void eval(char var, const float* values, int count, float* out);
+
+private:
+	friend struct MathExpression;
+
+	void update();
+	template<typename T>
+	void run(char var, const T* values, int count, T* out, std::vector<T>& blocks, std::vector<T>& temps);
+
+	const MathExpression* expr;
+	std::vector<double> vars; // Variables followed by the results of stages
+	int dirty;
+	std::vector<double> stack; // For the scalar interpreter
+	std::vector<double> temps;
+	std::vector<double> blocks; // Stack for batch evaluation
+	std::vector<float> floatBlocks;
+	std::vector<float> floatTemps;
+	std::vector<double> nativeConsts;
+	std::vector<float> nativeFloatConsts;
+};
+
 struct MathExpression
 {
-	static const int MAX_TOKENS = 128;
+	static const int BLOCK_SIZE = 64;
 
+	// Tokenizes and compiles the expression, eval() then only runs the program
 	MathExpression(const std::string& expr);
-	void setVar(char var, double value);
-	double eval(Status* status = 0);
+	// Compiles several expressions (e.g. one per color channel) into one
+	// program, computing the subexpressions they have in common only once
+	MathExpression(const std::vector<std::string>& exprs);
+	// Contexts point back to the expression
+	MathExpression(const MathExpression&) = delete;
+	MathExpression& operator=(const MathExpression&) = delete;
+	// OK, or the first error of compiling the expressions
+	Status getStatus() const { return status; }
+	// Variables are numbered at compile time, setting one is O(1) by slot
+	int getSlot(char var) const;
+	// The methods below that set variables and evaluate use a context owned
+	// by the expression, for use from one thread
+	void setSlot(int slot, double value) { context.setSlot(slot, value); }
+	void setVar(char var, double value) { context.setVar(var, value); }
+	void bind(double x, double y) { context.bind(x, y); }
+	// Splits off the parts of the expression that only depend on imageVars
+	// and the parts that only depend on rowVars (and imageVars), which then
+	// only rerun when one of those variables is set. Subexpressions that are
+	// constant are always folded.
+	void hoist(const std::string& imageVars, const std::string& rowVars);
+	// Returns the result of the first expression
+	double eval(Status* status = 0) { return context.eval(status); }
+	// Stores the result of each expression
+	void eval(double* results, Status* status = 0) { context.eval(results, status); }
+	// Evaluates count results at once, var taking the value values[i] for
+	// result i (such as a span of x coordinates). Each instruction is run over
+	// a block of values at a time, so the loops can be vectorized. With
+	// several expressions out holds count results for each in turn.
+	void eval(char var, const double* values, int count, double* out) { context.eval(var, values, count, out); }
+	void eval(char var, const float* values, int count, float* out) { context.eval(var, values, count, out); }
+	// Compiles the program to machine code (x86-64 with AVX only), which
+	// eval() above of that precision then uses for that var. Returns false
+	// if not supported.
+	bool compileNative(char var, Precision precision = PRECISION_DOUBLE);
 
-	static std::vector<Function> funcs;
+	// Functions and constants must be registered before any expression is
+	// compiled, after that they are only read. Compiled programs refer to
+	// the functions, which a deque keeps in place.
+	static std::deque<Function> funcs;
 	static std::vector<Constant> consts;
 
-	static double eval(const std::string& expr, Status* status = 0) {
-		MathExpression e(expr);
-		return e.eval(status);
-	}
+	// Evaluates a one-off expression with all variables 0
+	static double eval(const std::string& expr, Status* status = 0);
 
 private:
-	Token tokens[MAX_TOKENS];
+	friend struct MathContext;
+	struct Node;
+
+	// Only parses, for the one-off eval()
+	MathExpression(): context(*this) {}
+
+	void parse(const std::string& expr);
+	void compile();
+	void optimize();
+	void emit(const std::vector<Node>& nodes, int node, int level, std::vector<Instruction>& out, std::vector<int>& emitted);
+
+	std::vector<Instruction> source; // As compiled
+	std::vector<Instruction> program; // Optimized, per pixel part
+	std::vector<Instruction> stages[2]; // Hoisted image and row parts
+	std::vector<char> varNames; // By slot
+	std::vector<int> varLevels;
+	std::vector<int> slotStages; // Stages to rerun when the variable changes
+	int slotCount = 0; // Variables followed by the results of stages
+	int xSlot = -1, ySlot = -1;
+	int outputs = 0; // Number of expressions
+	int stackSize = 0; // Values left on the stack by the program
+	int maxStackSize = 0;
+	int sourceStackSize = 0; // Enough for any of the programs
+	int tempCount = 0;
+	int randomCount = 0; // Uses of rnd(m), each gets a seed
+	int randomKey = -1; // Hashed instead of x by the one-off eval()
+	std::shared_ptr<NativeCode> native;
+	int nativeSlot = -1;
+	Precision nativePrecision = PRECISION_DOUBLE;
+	std::vector<double> nativeConsts; // Without the variables
+	Status status = OK;
+	MathContext context;
 };
 
+inline void MathContext::setSlot(int slot, double value) {
+	vars[slot] = value;
+	dirty |= expr->slotStages[slot];
+}
+
+inline void MathContext::bind(double x, double y) {
+	if (expr->xSlot >= 0) setSlot(expr->xSlot, x);
+	if (expr->ySlot >= 0) setSlot(expr->ySlot, y);
+}
+
 } // namespace